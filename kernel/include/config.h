@@ -3,9 +3,12 @@
 #define TMPFS_DEBUG
 #undef PIT_DEBUG
 #undef ALLOCATOR_DEBUG
+#undef PMM_DEBUG
 #define SYSCALL_DEBUG
 #undef VMM_DEBUG
+#undef VMALLOC_DEBUG
+#undef ACPI_DEBUG
 
 #define RR_QUANTUM 10
 #define MAX_PROC_FDS 256
-#define MAX_KMEM_CACHES 20
+#define MAX_KMEM_CACHES 96
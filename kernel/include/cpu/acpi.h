@@ -0,0 +1,33 @@
+#pragma once
+
+#include <libk/typedefs.h>
+#include <stivale2.h>
+
+struct acpi_rsdp {
+  char signature[8];
+  u8 checksum;
+  char oem_id[6];
+  u8 revision;
+  u32 rsdt_address;
+
+  // revision 2 and up
+  u32 length;
+  u64 xsdt_address;
+  u8 ext_checksum;
+  u8 reserved[3];
+} __attribute__((packed));
+
+struct acpi_sdt_header {
+  char signature[4];
+  u32 length;
+  u8 revision;
+  u8 checksum;
+  char oem_id[6];
+  char oem_table_id[8];
+  u32 oem_revision;
+  u32 creator_id;
+  u32 creator_revision;
+} __attribute__((packed));
+
+void acpi_init(struct stivale2_struct_tag_rsdp *rsdp_tag);
+void *acpi_find_table(const char *signature);
@@ -14,6 +14,8 @@
 #define GSBASE 0xC0000101
 #define KGSBASE 0xC0000102
 
+#define MAX_CORES 255
+
 typedef struct {
   u64 rdi;
   u64 rsi;
@@ -47,12 +49,53 @@ typedef struct {
   PageTable *pcr3;           // 0x18
 
   Registers * regs;
+  u32 id;                    // 0x28
+  u32 node;                  // 0x2c
 } __attribute__((packed)) LocalCpuData;
 
 void cpu_init(u8);
+void cpu_load_locals(u8);
 LocalCpuData *get_cpu_struct(u8);
 void dump_regs(Registers *);
 
+extern bool cpu_locals_ready;
+
+/* index of the cpu we are running on, 0 until the local data is loaded */
+static inline u32 cpu_current_id() {
+  u32 id;
+  if (!cpu_locals_ready)
+    return 0;
+  asm volatile("mov %%gs:0x28, %0" : "=r"(id));
+  return id;
+}
+
+/* numa node of the cpu we are running on */
+static inline u32 cpu_current_node() {
+  u32 node;
+  if (!cpu_locals_ready)
+    return 0;
+  asm volatile("mov %%gs:0x2c, %0" : "=r"(node));
+  return node;
+}
+
+static inline u32 cpu_lapic_id() {
+  u32 eax, ebx, ecx, edx;
+  asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+  return ebx >> 24;
+}
+
+/* disable interrupts and return the previous rflags */
+static inline u64 irq_save() {
+  u64 flags;
+  asm volatile("pushfq; pop %0; cli" : "=r"(flags)::"memory");
+  return flags;
+}
+
+static inline void irq_restore(u64 flags) {
+  if (flags & (1 << 9))
+    asm volatile("sti" ::: "memory");
+}
+
 
 static inline uint64_t rdmsr(uint64_t msr) {
   uint32_t low, high;
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <libk/typedefs.h>
+
+#define MAX_NUMA_NODES 8
+#define MAX_NUMA_RANGES 32
+
+void numa_init();
+
+u8 numa_node_count();
+u8 numa_node_of(u64 phys);
+u8 numa_cpu_node(u32 lapic_id);
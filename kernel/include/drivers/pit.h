@@ -3,6 +3,9 @@
 
 #include <libk/typedefs.h>
 
+/* timer interrupts since boot */
+extern volatile u64 g_ticks;
+
 void pit_init(u32 hz);
 void Sleep(u32 ms);
 void tick();
@@ -156,6 +156,12 @@ int vfs_lookup(VFSNode *cwd, VFSNode **out, const char *path, uint32_t flags,
 extern VFS vfs_root;
 extern VFSNode *root_vnode;
 
+/* constructed state is all zeroes */
+extern struct kmem_cache *vnode_cache;
+extern struct kmem_cache *file_cache;
+
+void vfs_cache_init();
+
 File *vfs_open(const char *name, int flags);
 int vfs_mkdir(const char *path, mode_t mode);
 int vfs_stat(const char *path, VFSNodeStat *);
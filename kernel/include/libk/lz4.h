@@ -0,0 +1,13 @@
+#pragma once
+
+#include <libk/typedefs.h>
+#include <stddef.h>
+
+/* lz4 block format, without the frame around it */
+#define LZ4_HASH_BITS 12
+#define LZ4_WORKMEM_SIZE (sizeof(u16) << LZ4_HASH_BITS)
+#define LZ4_MAX_INPUT 0xffff /* positions are kept in 16 bits */
+
+size_t lz4_compress(const u8 *src, size_t len, u8 *dst, size_t cap,
+                    void *work);
+i64 lz4_decompress(const u8 *src, size_t len, u8 *dst, size_t cap);
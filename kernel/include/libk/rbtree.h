@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Intrusive red-black tree.
+ *
+ * The tree doesn't know about keys. Callers walk down from the root
+ * themselves to find where a node goes, link it there with rb_link_node
+ * and then call rb_insert_color to rebalance.
+ */
+
+enum { RB_RED, RB_BLACK };
+
+struct rb_node {
+  struct rb_node *parent;
+  struct rb_node *left;
+  struct rb_node *right;
+  int colour;
+};
+
+struct rb_root {
+  struct rb_node *node;
+};
+
+#define RB_ROOT ((struct rb_root){NULL})
+
+#define rb_entry(ptr, type, member)                                            \
+  ((type *)((char *)(ptr)-offsetof(type, member)))
+
+#define rb_entry_safe(ptr, type, member)                                       \
+  ({                                                                           \
+    struct rb_node *__n = (ptr);                                               \
+    __n ? rb_entry(__n, type, member) : NULL;                                  \
+  })
+
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+                                struct rb_node **link) {
+  node->parent = parent;
+  node->left = node->right = NULL;
+  node->colour = RB_RED;
+  *link = node;
+}
+
+static inline bool rb_empty(struct rb_root *root) { return !root->node; }
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root);
+void rb_erase(struct rb_node *node, struct rb_root *root);
+
+struct rb_node *rb_first(struct rb_root *root);
+struct rb_node *rb_last(struct rb_root *root);
+struct rb_node *rb_next(struct rb_node *node);
+struct rb_node *rb_prev(struct rb_node *node);
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+
+typedef struct spinlock {
+  volatile int locked;
+} Spinlock;
+
+#define SPINLOCK_INIT                                                          \
+  { .locked = 0 }
+
+static inline void spin_lock(Spinlock *lock) {
+  while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE))
+    while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED))
+      asm volatile("pause");
+}
+
+static inline bool spin_trylock(Spinlock *lock) {
+  return !__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void spin_unlock(Spinlock *lock) {
+  __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
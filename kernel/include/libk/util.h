@@ -11,6 +11,8 @@
 
 #define ALIGN_UP(num, align) (((num) + ((align)-1)) & ~((align)-1))
 #define DIV_ROUND_UP(n, d) (((n) + (d)-1) / (d))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 #define CONTEXT(n) get_cpu_struct(n)->regs
 
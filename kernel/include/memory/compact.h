@@ -0,0 +1,3 @@
+#pragma once
+
+void *compact_alloc_2m();
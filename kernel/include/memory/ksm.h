@@ -0,0 +1,21 @@
+#pragma once
+
+#include <libk/typedefs.h>
+
+/* same-page merging of anonymous memory */
+#define KSM_SCAN_INTERVAL 100 /* ticks between batches */
+#define KSM_SCAN_BATCH 512    /* pages looked at per batch */
+
+struct ksm_stats {
+  u64 pages_shared;  // frames merged pages are kept in
+  u64 pages_sharing; // ptes pointing at them
+  u64 merges;        // pages given up for a shared frame so far
+  u64 unmerges;      // copies taken back by writes so far
+};
+
+u64 ksm_scan();
+void ksm_count_unmerge();
+void ksm_get_stats(struct ksm_stats *stats);
+
+void ksm_init();
+void ksm_proc();
@@ -7,15 +7,61 @@
 
 #define PMM_BLOCK_SIZE 4096
 #define PMM_BLOCKS_PER_BYTE 8
-#define PMM_MAX_BITMAPS 262144 /* up to 64 GiB memory (Takes up 2MiB) */
+#define PMM_MAX_ORDER 10 /* largest buddy block is 2^10 pages (4 MiB) */
+#define PMM_NO_BLOCK ((u64)-1)
+
+/* naturally aligned huge chunks */
+#define PMM_ORDER_2M 9
+#define PMM_ORDER_1G 18
+
+/* zones, by the highest address a device can reach */
+enum pmm_zone_type { ZONE_DMA, ZONE_DMA32, ZONE_NORMAL, ZONE_COUNT };
+
+#define ZONE_DMA_END 0x1000000ull /* 16 MiB */
+#define ZONE_DMA32_END 0x100000000ull /* 4 GiB */
+
+/* per-cpu page cache watermarks */
+#define PMM_PCP_LOW 4
+#define PMM_PCP_HIGH 96
+#define PMM_PCP_BATCH 32
+
+/* per physical page metadata, indexed by pfn */
+struct page {
+  u32 refcount; /* 0 while the page is free */
+  u32 mapcount; /* number of ptes pointing at it */
+  u32 flags;
+  void *owner; /* slab, page table, ... depending on flags */
+};
+
+enum page_flags {
+  PG_RESERVED = 1 << 0, /* not ram the allocator hands out */
+  PG_SLAB = 1 << 2,
+  PG_PAGETABLE = 1 << 3,
+  PG_KMEM = 1 << 4, /* backs a vmalloc area */
+  PG_KSM = 1 << 5,  /* shared by same-page merging */
+};
 
 void pmm_init(struct stivale2_struct_tag_memmap *meminfo);
 
+struct page *pmm_page(uintptr_t addr);
+void pmm_page_get(uintptr_t addr);
+void pmm_page_put(uintptr_t addr);
+
 void *pmm_alloc_block();
 void *pmm_alloc_blocks(size_t blocks);
+void *pmm_alloc_blocks_zone(size_t blocks, u8 zone);
+void *pmm_alloc_blocks_node(size_t blocks, u8 node);
 void pmm_free_block(uintptr_t addr);
 void pmm_free_blocks(uintptr_t addr, u64 blocks);
 
+void *pmm_alloc_huge(u8 order);
+void pmm_free_huge(uintptr_t addr, u8 order);
+
+// compaction helpers
+void pmm_drain_cache();
+u64 pmm_count_used(uintptr_t addr, u64 blocks);
+void pmm_isolate(uintptr_t addr, u64 blocks);
+
 u64 pmm_get_free_block_count();
 u64 pmm_get_block_count();
 
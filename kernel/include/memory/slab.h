@@ -1,10 +1,19 @@
 #pragma once
 
+#include <cpu/cpu.h>
+#include <libk/spinlock.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <sys/queue.h>
 #include <unistd.h>
 
+#define KMEM_MAX_SIZE 16384 /* largest kmem_alloc served by a slab */
+#define KMEM_MAG_SIZE 15 /* objects per magazine */
+#define KMEM_KEEP_EMPTY 1 /* empty slabs a periodic reap leaves per cache */
+#define KMEM_REAP_INTERVAL 2000 /* ticks between periodic reaps */
+
 struct kmem_slab;
+struct kmem_cache;
 
 LIST_HEAD(slab_list, kmem_slab);
 
@@ -12,26 +21,79 @@ struct kmem_slab {
   void *free;
   void *page;
   void *boundary;
+  struct kmem_cache *cache;
 
-  int refcnt;
+  void *objs; // first object
+  u32 total;  // objects in the slab
+  u32 refcnt; // objects handed out, including those sitting in magazines
 
   LIST_ENTRY(kmem_slab) entries;
 };
 
+/* a stack of free objects, held by a cpu or sitting in the depot */
+struct kmem_magazine {
+  u64 rounds;
+  void *objs[KMEM_MAG_SIZE];
+
+  LIST_ENTRY(kmem_magazine) entries;
+};
+
+LIST_HEAD(magazine_list, kmem_magazine);
+
+struct kmem_cpu_cache {
+  struct kmem_magazine *loaded;
+  struct kmem_magazine *prev;
+};
+
 struct kmem_cache {
-  struct slab_list slabs;
+  const char *name;
+
+  struct slab_list slabs_full;
+  struct slab_list slabs_partial;
+  struct slab_list slabs_empty;
+  u64 empty_slabs;
+
   size_t objsize;
+  size_t align;
+  size_t stride;   // distance between objects
+  size_t link_off; // freelist link, after the object if there's a ctor
+
+  size_t colour_off;
+  size_t colour_next;
+  size_t slab_pages;
+
+  // kmem_alloc internal fragmentation, cumulative
+  u64 allocs;
+  u64 requested;
+
+  void (*ctor)(void *);
+  void (*dtor)(void *);
+
+  struct kmem_cpu_cache cpu[MAX_CORES];
+
+  // depot, protected by lock along with the slab lists
+  struct magazine_list full;
+  struct magazine_list empty;
+  u64 full_mags, empty_mags;
+  u64 full_min, empty_min; // unused working set since the last reap
+  Spinlock lock;
 };
 
-struct kmem_cache kmem_cache_create(size_t sz);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     size_t align, void (*ctor)(void *),
+                                     void (*dtor)(void *));
+void *kmem_cache_alloc(struct kmem_cache *cp);
 void kmem_cache_free(struct kmem_cache *cp, void *buf);
 
 // backend
 void kmem_cache_grow(struct kmem_cache *cp);
-void kmem_cache_reap(struct kmem_cache *cp, void *buf);
+u64 kmem_cache_reap(struct kmem_cache *cp, bool force);
+u64 kmem_reap(bool force);
+void kmem_reaper_proc();
 
 // frontend
 void *kmem_alloc(size_t sz);
 void kmem_free(void *ptr);
 
 void kmem_init();
+void kmem_dump();
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <libk/typedefs.h>
+
+/* transparent huge pages for anonymous memory */
+#define THP_SCAN_INTERVAL 1000 /* ticks between collapse scans */
+#define THP_COLLAPSE_BATCH 8   /* huge pages made per scan at most */
+
+u64 thp_collapse();
+void thp_proc();
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <libk/typedefs.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* one pml4 slot of kernel address space for virtually contiguous buffers */
+#define VMALLOC_START 0xffffc00000000000
+#define VMALLOC_END 0xffffc08000000000 /* 512 GiB */
+
+void vmalloc_init();
+
+void *vmalloc(size_t size);
+void vfree(void *addr);
+
+uintptr_t vmalloc_to_phys(void *addr);
+uintptr_t vmalloc_to_page(void *addr, size_t *size);
+
+static inline bool is_vmalloc_addr(void *addr) {
+  return (uintptr_t)addr >= VMALLOC_START && (uintptr_t)addr < VMALLOC_END;
+}
@@ -1,7 +1,10 @@
 #pragma once
 
 #define PAGE_SIZE 4096
+#define PAGE_SIZE_2M 0x200000ull
+#define PAGE_SIZE_1G 0x40000000ull
 
+#include <libk/rbtree.h>
 #include <libk/typedefs.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -13,9 +16,40 @@
 typedef struct process_control_block ProcessControlBlock;
 
 enum {
-  PAGE_PRESENT = 1 << 0, // same as 1
-  PAGE_WRITE = 1 << 1,   // same as 2, binary 10
-  PAGE_USER = 1 << 2,    // same as 4, binary 100
+  PAGE_PRESENT = 1 << 0,      // same as 1
+  PAGE_WRITE = 1 << 1,        // same as 2, binary 10
+  PAGE_USER = 1 << 2,         // same as 4, binary 100
+  PAGE_WRITETHROUGH = 1 << 3, // PWT, with PCD picks the PAT entry
+  PAGE_NOCACHE = 1 << 4,      // PCD
+  PAGE_ACCESSED = 1 << 5,     // set by the cpu on every access
+  PAGE_DIRTY = 1 << 6,        // set by the cpu on every write
+
+  PAGE_HUGE = 1 << 7,     // PS, the entry maps a 2M/1G page itself
+  PAGE_GLOBAL = 1 << 8,   // survives cr3 writes, used for the kernel half
+  PAGE_COW = 1 << 9,      // first available bit, write faults copy the frame
+  PAGE_SWAPPED = 1 << 10, // not present, the pte holds a zswap entry
+};
+
+#define PAGE_ADDR_MASK 0x000ffffffffff000
+
+/* anonymous faults also back their neighbours, in pages */
+#define FAULT_AROUND_MIN 8   /* aligned window around a random fault */
+#define FAULT_AROUND_MAX 512 /* what a sequential scan can grow it to */
+
+/* memory types, vmm_init programs the PAT so PWT and PCD select these */
+enum {
+  CACHE_WB = 0,                                // PAT0, ordinary memory
+  CACHE_WC = PAGE_WRITETHROUGH,                // PAT1, framebuffers
+  CACHE_UC_MINUS = PAGE_NOCACHE,               // PAT2, mtrrs may override
+  CACHE_UC = PAGE_WRITETHROUGH | PAGE_NOCACHE, // PAT3, device registers
+};
+
+#define PAGE_CACHE_MASK (PAGE_WRITETHROUGH | PAGE_NOCACHE)
+
+/* VASRangeNode flags */
+enum {
+  VM_ANON = 1 << 0,   // private memory only this process maps, can be moved
+  VM_SHARED = 1 << 1, // frames shared with the kernel or a device
 };
 
 typedef struct {
@@ -34,33 +68,86 @@ typedef struct {
   bool accessed : 1;
   bool zero0 : 1;
   bool size : 1;
-  bool zero1 : 1;
+  bool global : 1;
   u8 available : 3;
   u64 address : 52;
 } __attribute__((packed)) PageTableEntry;
 
 typedef struct vas_range_node {
   void *virt_start;
-  void *phys_start;
   size_t size;
 
   int page_flags;
+  int vm_flags;
+
+  // sequential access detection for fault-around
+  uintptr_t fault_next; // where the last window ended
+  u32 fault_window;     // pages the next sequential fault maps
 
-  struct vas_range_node *next;
-} __attribute__((packed)) VASRangeNode;
+  struct rb_node rb; // in the owner's vas tree, keyed by virt_start
+} VASRangeNode;
 
 typedef struct {
   PageTableEntry entries[512];
 } __attribute__((packed)) PageTable;
 
-void vmm_map_page(PageTable *, uintptr_t, uintptr_t, int);
+/* walks a range without going back to the pml4 for every address */
+struct vmm_cursor {
+  uintptr_t *pml4;
+  uintptr_t *tables[3]; // pml3, pml2 and pml1 of the last walk
+  uintptr_t tags[3];    // the address bits each of them was found under
+};
+
+void vmm_cursor_init(struct vmm_cursor *, PageTable *);
+uintptr_t *vmm_cursor_entry(struct vmm_cursor *, uintptr_t, size_t *);
+bool vmm_cursor_map(struct vmm_cursor *, uintptr_t, uintptr_t, int, size_t);
+uintptr_t vmm_cursor_unmap(struct vmm_cursor *, uintptr_t, size_t *);
+
+/* where a walk over anonymous memory left off, zeroed to start afresh */
+struct vmm_anon_hand {
+  ProcessControlBlock *proc; // NULL for the head of the ready queue
+  uintptr_t virt;
+};
+
+/* what a page visitor did, or'ed together */
+enum {
+  VMM_WALK_CHANGED = 1 << 0, // a pte changed, the tlb needs a flush
+  VMM_WALK_STOP = 1 << 1,    // the walk ends after this page
+};
+
+typedef int (*vmm_anon_visitor)(ProcessControlBlock *proc,
+                                VASRangeNode *range, struct vmm_cursor *cur,
+                                uintptr_t virt, uintptr_t *pte, void *ctx);
+
+bool vmm_walk_anon(struct vmm_anon_hand *, vmm_anon_visitor, void *);
+
+void vmm_map_page(PageTable *, uintptr_t, uintptr_t, int, int);
+bool vmm_map_huge(PageTable *, uintptr_t, uintptr_t, int, size_t);
+uintptr_t vmm_unmap(PageTable *, uintptr_t, size_t *);
+void vmm_unmap_range(PageTable *, uintptr_t, size_t, bool);
+void vmm_protect_range(PageTable *, uintptr_t, size_t, int, bool);
+bool vmm_collapse_huge(PageTable *, uintptr_t);
+uintptr_t *vmm_get_pte(PageTable *, uintptr_t);
+uintptr_t *vmm_get_entry(PageTable *, uintptr_t, size_t *);
+uintptr_t vmm_virt_to_phys(PageTable *, uintptr_t);
 PageTable *vmm_create_user_proc_pml4(ProcessControlBlock *);
 PageTable *vmm_create_kernel_proc_pml4(ProcessControlBlock *);
 PageTable *vmm_get_current_cr3();
 
 void vmm_copy_vas(ProcessControlBlock *, ProcessControlBlock *);
+bool vmm_handle_fault(ProcessControlBlock *, uintptr_t, int);
+
+u16 vmm_alloc_pcid();
+u64 vmm_proc_cr3(ProcessControlBlock *);
+void vmm_flush_tlb(ProcessControlBlock *);
 void vmm_switch_page_directory(PageTable *);
 void vmm_map_range(PageTable *cr3, void *virt_start, void *phys_start,
-                   size_t size, int flags);
+                   size_t size, int flags, int cache);
+void vmm_set_cache(void *virt, size_t size, int cache);
 
 void vmm_init();
+void vmm_init_pat();
+
+static inline void vmm_invlpg(uintptr_t virt) {
+  asm volatile("invlpg (%0)" ::"r"(virt) : "memory");
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <libk/typedefs.h>
+#include <stddef.h>
+
+/* pre-zeroed page pool */
+#define ZERO_POOL_PAGES 256 /* 1 MiB of ready pages */
+#define ZERO_POOL_BATCH 16  /* pages cleared per wakeup of the zero thread */
+#define ZERO_POOL_LOW 64    /* the zero thread sleeps until it drops below */
+
+void zero_pages(void *virt, u64 pages);
+
+void *zero_alloc_block();
+u64 zero_pool_count();
+
+void zero_proc();
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <libk/typedefs.h>
+#include <memory/vmm.h>
+#include <stdbool.h>
+
+/* compressed swap in ram for anonymous pages */
+#define ZSWAP_SCAN_INTERVAL 1000 /* ticks between turns of the clock */
+#define ZSWAP_LOW_PAGES 4096     /* free pages below which we compress */
+#define ZSWAP_SCAN_BATCH 512     /* pages compressed per turn at most */
+#define ZSWAP_MAX_LEN (PAGE_SIZE * 3 / 4) /* worse than this isn't kept */
+#define ZSWAP_MAX_POOL_PERCENT 20 /* of ram the compressed pages may use */
+
+/* a pte left behind by a compressed page */
+static inline bool zswap_swapped(uintptr_t pte) {
+  return !(pte & PAGE_PRESENT) && (pte & PAGE_SWAPPED);
+}
+
+void zswap_load(uintptr_t pte, uintptr_t frame);
+void zswap_dup(uintptr_t pte);
+void zswap_drop(uintptr_t pte);
+
+u64 zswap_reclaim(u64 pages);
+void zswap_init();
+void zswap_proc();
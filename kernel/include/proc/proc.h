@@ -10,7 +10,8 @@
 
 #define STACK_BLOCKS 32
 #define STACK_SIZE STACK_BLOCKS *PAGE_SIZE
-#define MMAP_BASE 0xC000000000
+#define MMAP_BASE 0xC000000000   /* lowest address mmap hands out */
+#define MMAP_END 0x7ff000000000  /* and the end of the highest */
 
 enum TaskState { READY, RUNNING, ZOMBIE, WAITING };
 
@@ -29,11 +30,13 @@ typedef struct process_control_block {
   Registers trapframe;
   void *kstack;
   PageTable *cr3;
+  u16 pcid;       // tags this address space's tlb entries
+  bool tlb_stale; // tables changed while not running, flush on next switch
 
   enum TaskState state;
+  u64 wakeup; // tick a sleeping process is made ready again, 0 for none
 
-  VASRangeNode *vas;
-  uint64_t mmap_base;
+  struct rb_root vas; // VASRangeNodes, never overlapping
 
   struct file *fd_table[MAX_PROC_FDS];
   int fd_length;
@@ -62,13 +65,35 @@ void dump_proc_vas(ProcessControlBlock *);
 void multitasking_init();
 
 void proc_add_vas_range(ProcessControlBlock *, VASRangeNode *);
+void proc_remove_vas_range(ProcessControlBlock *, uintptr_t, size_t);
+VASRangeNode *proc_find_vas_range(ProcessControlBlock *, uintptr_t);
+VASRangeNode *proc_vas_lower_bound(ProcessControlBlock *, uintptr_t);
+uintptr_t proc_find_vas_gap(ProcessControlBlock *, uintptr_t, size_t, size_t);
+
+static inline VASRangeNode *proc_first_vas_range(ProcessControlBlock *proc) {
+  return rb_entry_safe(rb_first(&proc->vas), VASRangeNode, rb);
+}
+
+static inline VASRangeNode *proc_next_vas_range(VASRangeNode *node) {
+  return rb_entry_safe(rb_next(&node->rb), VASRangeNode, rb);
+}
 
 ProcessControlBlock *create_process(void(void));
 ProcessControlBlock *clone_process(ProcessControlBlock *proc, Registers *regs);
 
 ProcessControlBlock *get_next_ready_process();
 
+/*
+ * Constructed state is all zeroes (with an empty child list), objects
+ * must be handed back to their cache that way.
+ */
+extern struct kmem_cache *pcb_cache;
+extern struct kmem_cache *vas_range_cache;
+
+void proc_cache_init();
+
 void register_process(ProcessControlBlock *);
+void proc_sleep(u64 ticks);
 
 void schedule(Registers *);
 
@@ -34,5 +34,7 @@ typedef unsigned long long caddr_t;
 #define SYS_ACCESS 24
 #define SYS_CLOCK 25
 #define SYS_SPAWN_THREAD 26
+#define SYS_VM_UNMAP 27
+#define SYS_VM_PROTECT 28
 
 void sys_init();
@@ -0,0 +1,69 @@
+#include <config.h>
+#include <cpu/acpi.h>
+#include <libk/kprintf.h>
+#include <memory/vmm.h>
+#include <string/string.h>
+
+static struct acpi_sdt_header *root; // RSDT or XSDT
+static bool use_xsdt = false;
+
+/* tables are found by physical address, reach them through the hhdm */
+static void *acpi_phys(u64 addr) {
+  if (addr >= (u64)PAGING_VIRTUAL_OFFSET)
+    return (void *)addr;
+  return PAGING_VIRTUAL_OFFSET + (void *)addr;
+}
+
+static bool acpi_checksum(void *table, u64 length) {
+  u8 sum = 0;
+  for (u64 i = 0; i < length; i++)
+    sum += ((u8 *)table)[i];
+  return sum == 0;
+}
+
+void acpi_init(struct stivale2_struct_tag_rsdp *rsdp_tag) {
+  if (!rsdp_tag) {
+    kprintf("[ACPI] No RSDP from the bootloader\n");
+    return;
+  }
+
+  struct acpi_rsdp *rsdp = acpi_phys(rsdp_tag->rsdp);
+
+  if (memcmp(rsdp->signature, "RSD PTR ", 8) || !acpi_checksum(rsdp, 20)) {
+    kprintf("[ACPI] Invalid RSDP\n");
+    return;
+  }
+
+  if (rsdp->revision >= 2 && rsdp->xsdt_address) {
+    root = acpi_phys(rsdp->xsdt_address);
+    use_xsdt = true;
+  } else {
+    root = acpi_phys(rsdp->rsdt_address);
+  }
+
+#ifdef ACPI_DEBUG
+  kprintf("[ACPI] %s at 0x%llx\n", use_xsdt ? "XSDT" : "RSDT", root);
+#endif
+}
+
+void *acpi_find_table(const char *signature) {
+  if (!root)
+    return NULL;
+
+  u64 entry_size = use_xsdt ? 8 : 4;
+  u64 entries = (root->length - sizeof(struct acpi_sdt_header)) / entry_size;
+  void *table_ptrs = (void *)root + sizeof(struct acpi_sdt_header);
+
+  for (u64 i = 0; i < entries; i++) {
+    // xsdt entries are only 4 byte aligned
+    u64 addr = 0;
+    memcpy(&addr, table_ptrs + i * entry_size, entry_size);
+    struct acpi_sdt_header *hdr = acpi_phys(addr);
+
+    if (!memcmp(hdr->signature, signature, 4) &&
+        acpi_checksum(hdr, hdr->length))
+      return hdr;
+  }
+
+  return NULL;
+}
@@ -1,12 +1,12 @@
 #include <cpu/cpu.h>
+#include <cpu/numa.h>
 #include <libk/kprintf.h>
 #include <libk/typedefs.h>
 #include <memory/pmm.h>
 #include <memory/vmm.h>
 
-#define MAX_CORES 255
-
 LocalCpuData cpus[MAX_CORES];
+bool cpu_locals_ready = false;
 
 void cpu_init(u8 id) {
     kprintf("Initializing CPU #%lu\n", id);
@@ -23,10 +23,18 @@ void cpu_init(u8 id) {
         panic();
     }
     cpus[id].kcr3 = vmm_get_current_cr3();
+    cpus[id].id = id;
+    cpus[id].node = numa_cpu_node(cpu_lapic_id());
 
     return;
 }
 
+void cpu_load_locals(u8 id) {
+    wrmsr(GSBASE, (u64)&cpus[id]);  //  GSBase
+    wrmsr(KGSBASE, (u64)&cpus[id]); // KernelGSBase
+    cpu_locals_ready = true;
+}
+
 LocalCpuData *get_cpu_struct(u8 id) { return &cpus[id]; }
 
 void dump_regs(Registers *regs) {
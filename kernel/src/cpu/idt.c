@@ -141,9 +141,15 @@ void err13_handler(Registers *regs, int error_code) {
 }
 
 void err14_handler(Registers *regs, int error_code) {
+  uintptr_t addr;
+  asm("mov %%cr2, %0" : "=r"(addr)::);
 
-  kprintf("\nEXCEPTION: Page Fault #PF\n");
+  // lazily backed and copy-on-write pages fault on purpose
   extern ProcessControlBlock *running;
+  if (vmm_handle_fault(running, addr, error_code))
+    return;
+
+  kprintf("\nEXCEPTION: Page Fault #PF\n");
   kprintf("Currently running process: %s (pid %d) kstack at 0x%x (base: %x)\n",
           running->name, running->pid, running->kstack,
           running->kstack - STACK_SIZE);
@@ -156,9 +162,6 @@ void err14_handler(Registers *regs, int error_code) {
                                   : "Caused by read access\n");
   kprintf(error_code & PAGE_USER ? "User mode #PF\n" : "Kernel mode #PF\n");
 
-  uintptr_t addr;
-  asm("mov %%cr2, %0" : "=r"(addr)::);
-
   kprintf("Faulting address: 0x%p\n", addr);
 
   dump_regs(regs);
@@ -172,7 +175,6 @@ void irq0_handler(Registers *regs) {
   tick();
 
   outb(0x20, 0x20); /* EOI */
-  extern u64 g_ticks;
   if (g_ticks % RR_QUANTUM == 0)
     schedule(regs);
 }
@@ -391,7 +393,6 @@ void idt_init() {
 }
 
 void Sleep(u32 ms) {
-  extern u64 g_ticks;
   u64 et = g_ticks + ms;
 
   while (g_ticks != et) {
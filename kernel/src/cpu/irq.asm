@@ -166,12 +166,29 @@ err13:
     popaq
 
 err14:
-    mov dword rsi, [rsp]
-    add rsp, 8
-    pushaq
+    ; page faults can be resolved and returned from, so the interrupted
+    ; rsi has to survive. Swap the error code for r8 instead, its slot on
+    ; the stack is then exactly where pushaq would have put r8.
+    xchg r8, [rsp]
+    push qword r9
+    push qword r10
+    push qword r11
+    push qword r12
+    push qword r13
+    push qword r14
+    push qword r15
+    push qword rbp
+    push qword rdx
+    push qword rcx
+    push qword rbx
+    push qword rax
+    push qword rsi
+    push qword rdi
+    mov rsi, r8
     mov rdi, rsp
     call err14_handler
     popaq
+    iretq
 
 
 irq0:
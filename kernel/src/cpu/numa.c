@@ -0,0 +1,179 @@
+#include <config.h>
+#include <cpu/acpi.h>
+#include <cpu/cpu.h>
+#include <cpu/numa.h>
+#include <libk/kprintf.h>
+
+/*
+ * NUMA topology from the ACPI SRAT.
+ *
+ * Proximity domains are renumbered into dense node ids in the order they
+ * are first seen. Without an SRAT everything is node 0.
+ */
+
+#define SRAT_CPU_AFFINITY 0
+#define SRAT_MEM_AFFINITY 1
+#define SRAT_X2APIC_AFFINITY 2
+
+#define SRAT_ENABLED (1 << 0)
+
+struct srat {
+  struct acpi_sdt_header header;
+  u8 reserved[12];
+} __attribute__((packed));
+
+struct srat_entry {
+  u8 type;
+  u8 length;
+} __attribute__((packed));
+
+struct srat_cpu_affinity {
+  struct srat_entry entry;
+  u8 domain_lo;
+  u8 apic_id;
+  u32 flags;
+  u8 sapic_eid;
+  u8 domain_hi[3];
+  u32 clock_domain;
+} __attribute__((packed));
+
+struct srat_mem_affinity {
+  struct srat_entry entry;
+  u32 domain;
+  u16 reserved0;
+  u64 base;
+  u64 length;
+  u32 reserved1;
+  u32 flags;
+  u64 reserved2;
+} __attribute__((packed));
+
+struct srat_x2apic_affinity {
+  struct srat_entry entry;
+  u16 reserved0;
+  u32 domain;
+  u32 x2apic_id;
+  u32 flags;
+  u32 clock_domain;
+  u32 reserved1;
+} __attribute__((packed));
+
+static struct {
+  u64 base, end;
+  u8 node;
+} ranges[MAX_NUMA_RANGES];
+static u8 range_count = 0;
+
+static struct {
+  u32 lapic_id;
+  u8 node;
+} cpu_nodes[MAX_CORES];
+static u32 cpu_count = 0;
+
+static u32 domains[MAX_NUMA_NODES];
+static u8 node_count = 1;
+
+/* dense node id for a proximity domain */
+static u8 domain_node(u32 domain) {
+  static u8 seen = 0;
+
+  for (u8 i = 0; i < seen; i++)
+    if (domains[i] == domain)
+      return i;
+
+  if (seen == MAX_NUMA_NODES) {
+    kprintf("[NUMA] Too many proximity domains, folding %u into node 0\n",
+            domain);
+    return 0;
+  }
+
+  domains[seen] = domain;
+  node_count = seen + 1;
+  return seen++;
+}
+
+static void add_cpu(u32 lapic_id, u32 domain) {
+  if (cpu_count == MAX_CORES)
+    return;
+
+  cpu_nodes[cpu_count].lapic_id = lapic_id;
+  cpu_nodes[cpu_count].node = domain_node(domain);
+  cpu_count++;
+}
+
+void numa_init() {
+  struct srat *srat = acpi_find_table("SRAT");
+  if (!srat) {
+    kprintf("[NUMA] No SRAT, assuming a single node\n");
+    return;
+  }
+
+  void *ptr = (void *)srat + sizeof(struct srat);
+  void *end = (void *)srat + srat->header.length;
+
+  for (; ptr < end; ptr += ((struct srat_entry *)ptr)->length) {
+    struct srat_entry *entry = ptr;
+    if (entry->length == 0)
+      break;
+
+    switch (entry->type) {
+    case SRAT_CPU_AFFINITY: {
+      struct srat_cpu_affinity *cpu = ptr;
+      if (!(cpu->flags & SRAT_ENABLED))
+        break;
+
+      u32 domain = cpu->domain_lo | (cpu->domain_hi[0] << 8) |
+                   (cpu->domain_hi[1] << 16) | (cpu->domain_hi[2] << 24);
+      add_cpu(cpu->apic_id, domain);
+      break;
+    }
+    case SRAT_X2APIC_AFFINITY: {
+      struct srat_x2apic_affinity *cpu = ptr;
+      if (cpu->flags & SRAT_ENABLED)
+        add_cpu(cpu->x2apic_id, cpu->domain);
+      break;
+    }
+    case SRAT_MEM_AFFINITY: {
+      struct srat_mem_affinity *mem = ptr;
+      if (!(mem->flags & SRAT_ENABLED) || !mem->length)
+        break;
+
+      if (range_count == MAX_NUMA_RANGES) {
+        kprintf("[NUMA] Too many memory ranges in the SRAT\n");
+        break;
+      }
+
+      ranges[range_count].base = mem->base;
+      ranges[range_count].end = mem->base + mem->length;
+      ranges[range_count].node = domain_node(mem->domain);
+      range_count++;
+      break;
+    }
+    }
+  }
+
+  kprintf("[NUMA] %u nodes, %u memory ranges, %u cpus\n", node_count,
+          range_count, cpu_count);
+}
+
+u8 numa_node_count() { return node_count; }
+
+/* memory not described by the SRAT is given to node 0 */
+u8 numa_node_of(u64 phys) {
+  if (node_count == 1)
+    return 0;
+
+  for (u8 i = 0; i < range_count; i++)
+    if (ranges[i].base <= phys && phys < ranges[i].end)
+      return ranges[i].node;
+
+  return 0;
+}
+
+u8 numa_cpu_node(u32 lapic_id) {
+  for (u32 i = 0; i < cpu_count; i++)
+    if (cpu_nodes[i].lapic_id == lapic_id)
+      return cpu_nodes[i].node;
+
+  return 0;
+}
@@ -11,6 +11,7 @@
 #include <string/string.h>
 
 #include <memory/pmm.h>
+#include <memory/vmm.h>
 
 #define LOCKED_READ(VAR)                                                       \
   ({                                                                           \
@@ -37,6 +38,9 @@ static size_t alive_cpus = 1; // BSP already running
 
 void ap_startup() {
   __asm__ volatile("cli");
+
+  // memory types have to agree between cpus
+  vmm_init_pat();
   // increment alive cpus
   // LOCKED_INC(alive_cpus);
 
@@ -2,6 +2,7 @@
 #include "fs/tmpfs.h"
 #include "libk/util.h"
 #include "memory/pmm.h"
+#include "memory/vmalloc.h"
 #include "memory/vmm.h"
 #include <drivers/fb.h>
 #include <fs/devfs.h>
@@ -157,15 +158,17 @@ int fb_init(struct stivale2_struct_tag_framebuffer *fb_info) {
   fb_init_vsi(fb_info, &fb0_vsi);
   fb_init_fsi(fb_info, &fb0_fsi);
 
+  // fb_proc only ever streams whole frames into it, let the cpu combine
+  // the writes into bursts instead of going through the cache
+  vmm_set_cache((void *)fb0_fsi.mmio_start, fb0_fsi.mmio_len, CACHE_WC);
+
   VAttr attr = {.type = VFS_CHARDEVICE,
                 .size = fb0_fsi.mmio_len,
                 .rdev = MKDEV(FB_MAJOR, 0)};
   kprintf("Creating /dev/fb0\n");
   dev_root->ops->create(dev_root, &fb_vnode, "/dev/fb0", &attr);
   TmpNode *tnode = fb_vnode->private_data;
-  tnode->dev.cdev.private_data =
-      PAGING_VIRTUAL_OFFSET +
-      pmm_alloc_blocks(DIV_ROUND_UP(fb0_fsi.mmio_len, PAGE_SIZE));
+  tnode->dev.cdev.private_data = vmalloc(fb0_fsi.mmio_len);
 
   gp_backbuffer = tnode->dev.cdev.private_data;
 
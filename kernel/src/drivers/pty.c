@@ -91,7 +91,7 @@ static int ptmx_open(File *file, VFSNode *vn, int flags) {
   memset(pts_data, 0, sizeof(*pts_data));
 
   /* Initialize ptm node (entirely virtual)*/
-  VFSNode *ptm_node = kmem_alloc(sizeof(VFSNode));
+  VFSNode *ptm_node = kmem_cache_alloc(vnode_cache);
   ptm_node->stat.type = VFS_CHARDEVICE;
   ptm_node->ops = &ptm_ops;
   ptm_node->private_data = ptm_data;
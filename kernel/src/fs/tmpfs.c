@@ -12,6 +12,8 @@
 
 #include <sys/queue.h>
 
+static struct kmem_cache *dirent_cache;
+
 static int tmpfs_mount(VFS *vfs, const char *path, void *data) {
   TmpNode *tmp_root_node = kmem_alloc(sizeof(TmpNode));
   VFSNode *tmp_root_vnode;
@@ -47,7 +49,7 @@ static int tmpfs_vget(VFS *vfs, VFSNode **out, ino_t inode) {
     return 0;
   }
 
-  VFSNode *vnode = kmem_alloc(sizeof(VFSNode));
+  VFSNode *vnode = kmem_cache_alloc(vnode_cache);
   node->vnode = vnode;
   vnode->refcnt = 1;
 
@@ -133,7 +135,7 @@ loop:
 TmpNode *tmakenode(TmpNode *dtn, const char *name, struct vattr *vap) {
 
   TmpNode *tnode = kmem_alloc(sizeof(TmpNode));
-  struct tmpfs_dirent *dent = kmem_alloc(sizeof(struct tmpfs_dirent));
+  struct tmpfs_dirent *dent = kmem_cache_alloc(dirent_cache);
 
   dent->filename = strdup(name + strlen(dtn->name));
   dent->inode = tnode;
@@ -396,6 +398,9 @@ VNodeOps tmpfs_vnops = {.create = tmpfs_create,
                         .poll = tmpfs_poll};
 
 int tmpfs_init() {
+  dirent_cache = kmem_cache_create("tmpfs_dirent", sizeof(struct tmpfs_dirent),
+                                   0, NULL, NULL);
+
   vfs_root.ops = &tmpfs_vfsops;
   return vfs_root.ops->mount(&vfs_root, NULL, NULL);
 }
@@ -10,6 +10,19 @@
 VFS vfs_root;
 VFSNode *root_vnode;
 
+struct kmem_cache *vnode_cache;
+struct kmem_cache *file_cache;
+
+static void vnode_ctor(void *obj) { memset(obj, 0, sizeof(VFSNode)); }
+
+static void file_ctor(void *obj) { memset(obj, 0, sizeof(File)); }
+
+void vfs_cache_init() {
+  vnode_cache =
+      kmem_cache_create("vnode", sizeof(VFSNode), 64, vnode_ctor, NULL);
+  file_cache = kmem_cache_create("file", sizeof(File), 0, file_ctor, NULL);
+}
+
 extern ProcessControlBlock *running;
 static char *get_parent_dir(const char *path) {
   char *parent = strdup(path);
@@ -35,7 +48,7 @@ int namei(struct nameidata *ndp) {
 
 File *vfs_open(const char *name, int flags) {
 
-  File *file = kmem_alloc(sizeof(File));
+  File *file = kmem_cache_alloc(file_cache);
 
   kprintf("opening %s\n", name);
   if (name[0] == '.' && name[1] == '/') {
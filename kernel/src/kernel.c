@@ -4,14 +4,19 @@
 #define NULL (void *)0
 
 #include "fs/vfs.h"
+#include <cpu/acpi.h>
 #include <cpu/gdt.h>
 #include <cpu/idt.h>
 #include <cpu/io.h>
+#include <cpu/numa.h>
 #include <cpu/smp.h>
 #include <memory/slab.h>
 #include <libk/typedefs.h>
+#include <memory/ksm.h>
 #include <memory/pmm.h>
+#include <memory/vmalloc.h>
 #include <memory/vmm.h>
+#include <memory/zswap.h>
 
 #include <drivers/fb.h>
 #include <drivers/keyboard.h>
@@ -139,9 +144,21 @@ void _start(struct stivale2_struct *boot_info) {
   struct stivale2_struct_tag_framebuffer *framebuffer_tag =
       stivale2_get_tag(boot_info, STIVALE2_STRUCT_TAG_FRAMEBUFFER_ID);
 
+  struct stivale2_struct_tag_rsdp *rsdp_tag =
+      stivale2_get_tag(boot_info, STIVALE2_STRUCT_TAG_RSDP_ID);
+
+  // the pmm needs the numa layout to build its zones
+  acpi_init(rsdp_tag);
+  numa_init();
+
   pmm_init(meminfo);
   vmm_init();
   kmem_init();
+  vmalloc_init();
+  zswap_init();
+  ksm_init();
+  proc_cache_init();
+  vfs_cache_init();
 
   gdt_init();
   idt_init();
@@ -0,0 +1,210 @@
+#include <libk/lz4.h>
+#include <libk/util.h>
+#include <stdbool.h>
+#include <string/string.h>
+
+/*
+ * LZ4 block compression.
+ *
+ * A block is a list of sequences: a token byte with the literal count in
+ * its high nibble and the match length minus 4 in the low one, the
+ * literals, then a 16 bit little endian offset back to the match. A
+ * nibble of 15 continues into extra bytes that are added up until one
+ * isn't 255. The last sequence is only literals, and the format wants
+ * the last 5 bytes to be literals and no match to start within the last
+ * 12.
+ *
+ * The compressor is the simple greedy one: a hash of the next 4 bytes
+ * picks the last position that hashed the same, a match there is
+ * extended as far as it goes. It is not the fastest or the tightest,
+ * but its output is a valid block any lz4 decoder reads.
+ */
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MF_LIMIT 12
+#define MAX_OFFSET 0xffff
+
+static inline u32 read32(const u8 *p) {
+  u32 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline u32 hash(u32 seq) {
+  return (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+static u8 *put_length(u8 *op, size_t len) {
+  for (; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = len;
+
+  return op;
+}
+
+/* a sequence, without a match if `last`. NULL if it doesn't fit */
+static u8 *put_sequence(u8 *op, u8 *oend, const u8 *lits, size_t nlits,
+                        size_t offset, size_t mlen, bool last) {
+  size_t need = 1 + nlits + nlits / 255 + 1;
+  if (!last)
+    need += 2 + mlen / 255 + 1;
+
+  if (need > (size_t)(oend - op))
+    return NULL;
+
+  u8 *token = op++;
+  *token = MIN(nlits, 15) << 4;
+  if (nlits >= 15)
+    op = put_length(op, nlits - 15);
+
+  memcpy(op, lits, nlits);
+  op += nlits;
+
+  if (last)
+    return op;
+
+  *op++ = offset;
+  *op++ = offset >> 8;
+
+  mlen -= MIN_MATCH;
+  *token |= MIN(mlen, 15);
+  if (mlen >= 15)
+    op = put_length(op, mlen - 15);
+
+  return op;
+}
+
+/*
+ * Compress `len` bytes into at most `cap`. `work` is LZ4_WORKMEM_SIZE
+ * bytes of scratch. Returns the compressed size, 0 if it didn't fit.
+ */
+size_t lz4_compress(const u8 *src, size_t len, u8 *dst, size_t cap,
+                    void *work) {
+  u16 *table = work;
+  const u8 *ip = src;
+  const u8 *anchor = src; // start of the pending literals
+  const u8 *end = src + len;
+  u8 *op = dst;
+  u8 *oend = dst + cap;
+
+  if (len > LZ4_MAX_INPUT)
+    return 0;
+
+  memset(table, 0, LZ4_WORKMEM_SIZE);
+
+  if (len > MF_LIMIT) {
+    const u8 *mf_limit = end - MF_LIMIT;
+    const u8 *match_limit = end - LAST_LITERALS;
+
+    // position 0 is what the empty table points at anyway
+    ip++;
+
+    while (ip < mf_limit) {
+      u32 seq = read32(ip);
+      u32 h = hash(seq);
+      const u8 *ref = src + table[h];
+
+      table[h] = ip - src;
+
+      if (ip - ref > MAX_OFFSET || read32(ref) != seq) {
+        ip++;
+        continue;
+      }
+
+      // the match may have started in the literals before it
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+
+      const u8 *mp = ip + MIN_MATCH;
+      const u8 *rp = ref + MIN_MATCH;
+      while (mp < match_limit && *mp == *rp) {
+        mp++;
+        rp++;
+      }
+
+      op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, mp - ip,
+                        false);
+      if (!op)
+        return 0;
+
+      ip = anchor = mp;
+    }
+  }
+
+  op = put_sequence(op, oend, anchor, end - anchor, 0, 0, true);
+  if (!op)
+    return 0;
+
+  return op - dst;
+}
+
+/* NULL if the input ends in the middle of the length */
+static const u8 *get_length(const u8 *ip, const u8 *iend, size_t *len) {
+  u8 byte;
+
+  do {
+    if (ip >= iend)
+      return NULL;
+    byte = *ip++;
+    *len += byte;
+  } while (byte == 255);
+
+  return ip;
+}
+
+/*
+ * Decompress a block into at most `cap` bytes. Returns the decompressed
+ * size, -1 if the block is malformed or doesn't fit.
+ */
+i64 lz4_decompress(const u8 *src, size_t len, u8 *dst, size_t cap) {
+  const u8 *ip = src;
+  const u8 *iend = src + len;
+  u8 *op = dst;
+  u8 *oend = dst + cap;
+
+  while (ip < iend) {
+    u8 token = *ip++;
+
+    size_t nlits = token >> 4;
+    if (nlits == 15 && !(ip = get_length(ip, iend, &nlits)))
+      return -1;
+
+    if (nlits > (size_t)(iend - ip) || nlits > (size_t)(oend - op))
+      return -1;
+
+    memcpy(op, ip, nlits);
+    op += nlits;
+    ip += nlits;
+
+    // the last sequence has no match
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return -1;
+
+    size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+
+    if (!offset || offset > (size_t)(op - dst))
+      return -1;
+
+    size_t mlen = token & 15;
+    if (mlen == 15 && !(ip = get_length(ip, iend, &mlen)))
+      return -1;
+
+    mlen += MIN_MATCH;
+    if (mlen > (size_t)(oend - op))
+      return -1;
+
+    // matches may overlap what they produce, copy a byte at a time
+    const u8 *ref = op - offset;
+    while (mlen--)
+      *op++ = *ref++;
+  }
+
+  return op - dst;
+}
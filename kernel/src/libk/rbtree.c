@@ -0,0 +1,256 @@
+#include <libk/rbtree.h>
+
+static inline bool is_red(struct rb_node *node) {
+  return node && node->colour == RB_RED;
+}
+
+/* point whatever referenced `old` (its parent or the root) at `new` */
+static void replace_child(struct rb_node *old, struct rb_node *new,
+                          struct rb_node *parent, struct rb_root *root) {
+  if (!parent)
+    root->node = new;
+  else if (parent->left == old)
+    parent->left = new;
+  else
+    parent->right = new;
+}
+
+static void rotate_left(struct rb_node *node, struct rb_root *root) {
+  struct rb_node *right = node->right;
+
+  node->right = right->left;
+  if (right->left)
+    right->left->parent = node;
+
+  right->parent = node->parent;
+  replace_child(node, right, node->parent, root);
+
+  right->left = node;
+  node->parent = right;
+}
+
+static void rotate_right(struct rb_node *node, struct rb_root *root) {
+  struct rb_node *left = node->left;
+
+  node->left = left->right;
+  if (left->right)
+    left->right->parent = node;
+
+  left->parent = node->parent;
+  replace_child(node, left, node->parent, root);
+
+  left->right = node;
+  node->parent = left;
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root) {
+  struct rb_node *parent;
+
+  while ((parent = node->parent) && parent->colour == RB_RED) {
+    // a red parent is never the root, so the grandparent exists
+    struct rb_node *gparent = parent->parent;
+
+    if (parent == gparent->left) {
+      struct rb_node *uncle = gparent->right;
+
+      if (is_red(uncle)) {
+        uncle->colour = RB_BLACK;
+        parent->colour = RB_BLACK;
+        gparent->colour = RB_RED;
+        node = gparent;
+        continue;
+      }
+
+      if (node == parent->right) {
+        rotate_left(parent, root);
+        node = parent;
+        parent = node->parent;
+      }
+
+      parent->colour = RB_BLACK;
+      gparent->colour = RB_RED;
+      rotate_right(gparent, root);
+    } else {
+      struct rb_node *uncle = gparent->left;
+
+      if (is_red(uncle)) {
+        uncle->colour = RB_BLACK;
+        parent->colour = RB_BLACK;
+        gparent->colour = RB_RED;
+        node = gparent;
+        continue;
+      }
+
+      if (node == parent->left) {
+        rotate_right(parent, root);
+        node = parent;
+        parent = node->parent;
+      }
+
+      parent->colour = RB_BLACK;
+      gparent->colour = RB_RED;
+      rotate_left(gparent, root);
+    }
+  }
+
+  root->node->colour = RB_BLACK;
+}
+
+/* `node` (possibly NULL) under `parent` is one black short */
+static void erase_fixup(struct rb_node *node, struct rb_node *parent,
+                        struct rb_root *root) {
+  while (node != root->node && !is_red(node)) {
+    if (node == parent->left) {
+      struct rb_node *sibling = parent->right;
+
+      if (is_red(sibling)) {
+        sibling->colour = RB_BLACK;
+        parent->colour = RB_RED;
+        rotate_left(parent, root);
+        sibling = parent->right;
+      }
+
+      if (!is_red(sibling->left) && !is_red(sibling->right)) {
+        sibling->colour = RB_RED;
+        node = parent;
+        parent = node->parent;
+        continue;
+      }
+
+      if (!is_red(sibling->right)) {
+        sibling->left->colour = RB_BLACK;
+        sibling->colour = RB_RED;
+        rotate_right(sibling, root);
+        sibling = parent->right;
+      }
+
+      sibling->colour = parent->colour;
+      parent->colour = RB_BLACK;
+      sibling->right->colour = RB_BLACK;
+      rotate_left(parent, root);
+      node = root->node;
+    } else {
+      struct rb_node *sibling = parent->left;
+
+      if (is_red(sibling)) {
+        sibling->colour = RB_BLACK;
+        parent->colour = RB_RED;
+        rotate_right(parent, root);
+        sibling = parent->left;
+      }
+
+      if (!is_red(sibling->left) && !is_red(sibling->right)) {
+        sibling->colour = RB_RED;
+        node = parent;
+        parent = node->parent;
+        continue;
+      }
+
+      if (!is_red(sibling->left)) {
+        sibling->right->colour = RB_BLACK;
+        sibling->colour = RB_RED;
+        rotate_left(sibling, root);
+        sibling = parent->left;
+      }
+
+      sibling->colour = parent->colour;
+      parent->colour = RB_BLACK;
+      sibling->left->colour = RB_BLACK;
+      rotate_right(parent, root);
+      node = root->node;
+    }
+  }
+
+  if (node)
+    node->colour = RB_BLACK;
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root) {
+  struct rb_node *child, *parent;
+  int colour;
+
+  if (node->left && node->right) {
+    // swap in the successor, which has no left child
+    struct rb_node *next = node->right;
+    while (next->left)
+      next = next->left;
+
+    child = next->right;
+    parent = next->parent;
+    colour = next->colour;
+
+    if (parent == node) {
+      parent = next;
+    } else {
+      if (child)
+        child->parent = parent;
+      parent->left = child;
+
+      next->right = node->right;
+      node->right->parent = next;
+    }
+
+    next->left = node->left;
+    node->left->parent = next;
+    next->parent = node->parent;
+    next->colour = node->colour;
+    replace_child(node, next, node->parent, root);
+  } else {
+    child = node->left ? node->left : node->right;
+    parent = node->parent;
+    colour = node->colour;
+
+    if (child)
+      child->parent = parent;
+    replace_child(node, child, parent, root);
+  }
+
+  if (colour == RB_BLACK)
+    erase_fixup(child, parent, root);
+}
+
+struct rb_node *rb_first(struct rb_root *root) {
+  struct rb_node *node = root->node;
+  if (!node)
+    return NULL;
+
+  while (node->left)
+    node = node->left;
+  return node;
+}
+
+struct rb_node *rb_last(struct rb_root *root) {
+  struct rb_node *node = root->node;
+  if (!node)
+    return NULL;
+
+  while (node->right)
+    node = node->right;
+  return node;
+}
+
+struct rb_node *rb_next(struct rb_node *node) {
+  if (node->right) {
+    node = node->right;
+    while (node->left)
+      node = node->left;
+    return node;
+  }
+
+  while (node->parent && node == node->parent->right)
+    node = node->parent;
+  return node->parent;
+}
+
+struct rb_node *rb_prev(struct rb_node *node) {
+  if (node->left) {
+    node = node->left;
+    while (node->right)
+      node = node->right;
+    return node;
+  }
+
+  while (node->parent && node == node->parent->left)
+    node = node->parent;
+  return node->parent;
+}
@@ -22,9 +22,8 @@ void *memcpy(void *restrict dstptr, const void *restrict srcptr, size_t size) {
 }
 
 void *memset(void *bufptr, int value, size_t size) {
-  unsigned char *buf = (unsigned char *)bufptr;
-  for (size_t i = 0; i < size; i++)
-    buf[i] = (unsigned char)value;
+  void *buf = bufptr;
+  asm volatile("rep stosb" : "+D"(buf), "+c"(size) : "a"(value) : "memory");
   return bufptr;
 }
 
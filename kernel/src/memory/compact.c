@@ -0,0 +1,166 @@
+#include <cpu/cpu.h>
+#include <libk/kprintf.h>
+#include <libk/util.h>
+#include <memory/compact.h>
+#include <memory/pmm.h>
+#include <memory/slab.h>
+#include <memory/vmm.h>
+#include <proc/proc.h>
+#include <string/string.h>
+
+/*
+ * Memory compaction.
+ *
+ * When no free 2 MiB block is left we pick the 2 MiB window whose used
+ * frames are all private user pages (VM_ANON ranges of live processes,
+ * mapped only once so not shared copy-on-write after a fork),
+ * take the free blocks in it off the free lists and move every user page
+ * somewhere else. The whole window then belongs to the caller. If memory
+ * runs out halfway, the pages not moved yet stay and the rest of the
+ * window is freed again.
+ *
+ * There is no reverse mapping so user pages are found by walking the
+ * anonymous ranges of every process on the ready queue. This is slow, but
+ * it only runs when a huge allocation would otherwise fail. Interrupts
+ * stay off all along, a page counted as movable has to still be there
+ * when the window is emptied.
+ */
+
+#define WINDOW_BLOCKS (1ull << PMM_ORDER_2M)
+#define WINDOW_SIZE (WINDOW_BLOCKS * PAGE_SIZE)
+
+struct count_ctx {
+  u16 *movable;
+  u64 windows;
+};
+
+static int count_movable(ProcessControlBlock *proc, VASRangeNode *range,
+                         struct vmm_cursor *cur, uintptr_t virt,
+                         uintptr_t *pte, void *ctx) {
+  (void)proc;
+  (void)range;
+  (void)cur;
+  (void)virt;
+
+  struct count_ctx *cc = ctx;
+  u64 window = (*pte & PAGE_ADDR_MASK) / WINDOW_SIZE;
+
+  // a frame shared after fork has more than one pte to fix up, and a
+  // merged one is also known to ksm by its address
+  struct page *page = pmm_page(*pte & PAGE_ADDR_MASK);
+  if (page && (page->mapcount > 1 || (page->flags & PG_KSM)))
+    return 0;
+
+  if (window < cc->windows)
+    cc->movable[window]++;
+
+  return 0;
+}
+
+struct migrate_ctx {
+  uintptr_t window;
+  u64 moved;
+  bool failed; // ran out of frames to move pages to
+};
+
+static int migrate_page(ProcessControlBlock *proc, VASRangeNode *range,
+                        struct vmm_cursor *cur, uintptr_t virt, uintptr_t *pte,
+                        void *ctx) {
+  (void)proc;
+  (void)range;
+  (void)cur;
+  (void)virt;
+
+  struct migrate_ctx *mc = ctx;
+  uintptr_t phys = *pte & PAGE_ADDR_MASK;
+
+  if (phys < mc->window || phys >= mc->window + WINDOW_SIZE)
+    return 0;
+
+  // the window is isolated, so this can't come from inside it
+  void *new = pmm_alloc_block();
+  if (!new) {
+    mc->failed = true;
+    return VMM_WALK_STOP;
+  }
+
+  memcpy(PAGING_VIRTUAL_OFFSET + new, PAGING_VIRTUAL_OFFSET + (void *)phys,
+         PAGE_SIZE);
+
+  *pte = (uintptr_t)new | (*pte & ~PAGE_ADDR_MASK);
+
+  // the new frame takes over refcount, mapcount and owner
+  *pmm_page((uintptr_t)new) = *pmm_page(phys);
+
+  // the old frame stays marked used, it is now part of the window, and
+  // is free again if compaction gives up
+  *pmm_page(phys) = (struct page){0};
+  mc->moved++;
+
+  return VMM_WALK_CHANGED;
+}
+
+void *compact_alloc_2m() {
+  u64 windows = pmm_get_block_count() / WINDOW_BLOCKS;
+  u16 *movable = kmem_alloc(windows * sizeof(u16));
+  if (!movable)
+    return NULL;
+
+  memset(movable, 0, windows * sizeof(u16));
+
+  u64 flags = irq_save();
+
+  // cached pages look used to the bitmap
+  pmm_drain_cache();
+
+  struct count_ctx cc = {.movable = movable, .windows = windows};
+  struct vmm_anon_hand hand = {0};
+  vmm_walk_anon(&hand, count_movable, &cc);
+
+  // cheapest window where every used frame can be moved
+  u64 best = windows, best_used = WINDOW_BLOCKS + 1;
+  for (u64 w = 0; w < windows; w++) {
+    u64 used = pmm_count_used(w * WINDOW_SIZE, WINDOW_BLOCKS);
+    if (used == movable[w] && used < best_used) {
+      best = w;
+      best_used = used;
+    }
+  }
+
+  kmem_free(movable);
+
+  /*
+   * the free frames inside the window get isolated, moving the used ones
+   * out needs best_used more outside of it
+   */
+  if (best == windows || pmm_get_free_block_count() < WINDOW_BLOCKS) {
+    irq_restore(flags);
+    return NULL;
+  }
+
+  struct migrate_ctx mc = {
+      .window = best * WINDOW_SIZE, .moved = 0, .failed = false};
+
+  pmm_isolate(mc.window, WINDOW_BLOCKS);
+  vmm_walk_anon(&hand, migrate_page, &mc);
+
+  // pages that couldn't be moved stay, the rest of the window goes back
+  if (mc.failed) {
+    for (u64 i = 0; i < WINDOW_BLOCKS; i++) {
+      uintptr_t frame = mc.window + i * PAGE_SIZE;
+      struct page *page = pmm_page(frame);
+      if (page && !page->refcount)
+        pmm_free_block(frame);
+    }
+
+    irq_restore(flags);
+    kprintf("[COMPACT]  Out of memory after moving %llu pages\n", mc.moved);
+    return NULL;
+  }
+
+  irq_restore(flags);
+
+  kprintf("[COMPACT]  Moved %llu pages out of 0x%llx\n", mc.moved, mc.window);
+
+  return (void *)mc.window;
+}
@@ -0,0 +1,303 @@
+#include <cpu/cpu.h>
+#include <libk/kprintf.h>
+#include <libk/rbtree.h>
+#include <memory/ksm.h>
+#include <memory/pmm.h>
+#include <memory/slab.h>
+#include <memory/vmm.h>
+#include <proc/proc.h>
+#include <string/string.h>
+
+/*
+ * Same-page merging.
+ *
+ * Processes running the same binary hold many identical pages, each a
+ * private copy made by load_elf_segments or by a copy-on-write fault
+ * after fork. The "Merge" kernel process finds anonymous pages with the
+ * same contents and maps all of them to one frame, read-only and
+ * copy-on-write, so a write gives the writer its own copy back.
+ *
+ * Only pages that weren't written since the last pass are worth it:
+ * each pass clears the dirty bit of the private pages it looks at, and
+ * one that had it set is left for the next pass. The others are hashed.
+ * Merged frames are kept in the stable tree, keyed by hash, which holds a
+ * reference of its own so vmm_handle_cow never makes one writable in
+ * place. A page matching none of them goes in the unstable tree, built
+ * anew every pass, where the next identical page finds it and the two
+ * become a new stable frame. Stable frames only the tree still holds are
+ * freed at the start of a pass.
+ *
+ * A pass is done KSM_SCAN_BATCH pages at a time, so hashing a big address
+ * space doesn't keep interrupts off for long. Whatever the unstable tree
+ * points at may change in between, it is checked again before merging.
+ */
+
+struct ksm_node {
+  struct rb_node rb;
+  u64 hash;
+  uintptr_t phys;
+
+  // unstable nodes only, where the page is mapped
+  ProcessControlBlock *proc;
+  uintptr_t virt;
+};
+
+static struct kmem_cache *node_cache;
+static struct rb_root stable = RB_ROOT;
+static struct rb_root unstable = RB_ROOT;
+
+static u64 merges = 0;
+static u64 unmerges = 0;
+
+static struct vmm_anon_hand hand; // where the pass got to
+
+static inline struct ksm_node *node_entry(struct rb_node *node) {
+  return rb_entry_safe(node, struct ksm_node, rb);
+}
+
+static inline void *page_data(uintptr_t phys) {
+  return PAGING_VIRTUAL_OFFSET + (void *)phys;
+}
+
+/* fnv-1a a word at a time, collisions are caught by comparing pages */
+static u64 page_hash(uintptr_t phys) {
+  u64 *words = page_data(phys);
+  u64 hash = 0xcbf29ce484222325;
+
+  for (size_t i = 0; i < PAGE_SIZE / sizeof(u64); i++)
+    hash = (hash ^ words[i]) * 0x100000001b3;
+
+  return hash;
+}
+
+/* a node in `root` whose page has the same contents as `phys` */
+static struct ksm_node *tree_find(struct rb_root *root, u64 hash,
+                                  uintptr_t phys) {
+  struct rb_node *node = root->node;
+  struct ksm_node *found = NULL;
+
+  // the first node with the hash, pages that collide follow it
+  while (node) {
+    struct ksm_node *ksm = node_entry(node);
+
+    if (ksm->hash >= hash) {
+      found = ksm;
+      node = node->left;
+    } else {
+      node = node->right;
+    }
+  }
+
+  for (; found && found->hash == hash;
+       found = node_entry(rb_next(&found->rb)))
+    if (!memcmp(page_data(found->phys), page_data(phys), PAGE_SIZE))
+      return found;
+
+  return NULL;
+}
+
+static void tree_insert(struct rb_root *root, struct ksm_node *ksm) {
+  struct rb_node **link = &root->node;
+  struct rb_node *parent = NULL;
+
+  while (*link) {
+    parent = *link;
+    if (ksm->hash < node_entry(parent)->hash)
+      link = &parent->left;
+    else
+      link = &parent->right;
+  }
+
+  rb_link_node(&ksm->rb, parent, link);
+  rb_insert_color(&ksm->rb, root);
+}
+
+/* make a pte read-only, writes go through copy-on-write */
+static inline uintptr_t write_protect(uintptr_t pte) {
+  if (pte & PAGE_WRITE)
+    pte = (pte & ~(uintptr_t)PAGE_WRITE) | PAGE_COW;
+
+  return pte;
+}
+
+/* turn the page of an unstable node into a stable frame */
+static bool promote(struct ksm_node *ksm) {
+  PageTable *pml4 = (void *)ksm->proc->cr3 + PAGING_VIRTUAL_OFFSET;
+  uintptr_t *pte = vmm_get_pte(pml4, ksm->virt);
+
+  if (!pte || !(*pte & PAGE_PRESENT) || (*pte & PAGE_ADDR_MASK) != ksm->phys)
+    return false;
+
+  *pte = write_protect(*pte);
+  vmm_flush_tlb(ksm->proc);
+
+  pmm_page_get(ksm->phys);
+  pmm_page(ksm->phys)->flags |= PG_KSM;
+
+  rb_erase(&ksm->rb, &unstable);
+  ksm->proc = NULL;
+  ksm->virt = 0;
+  tree_insert(&stable, ksm);
+
+  return true;
+}
+
+/* share the page at `virt` with an identical one, if there is one yet */
+static bool merge_page(ProcessControlBlock *proc, struct vmm_cursor *cur,
+                       uintptr_t virt, uintptr_t *pte) {
+  uintptr_t phys = *pte & PAGE_ADDR_MASK;
+  u64 hash = page_hash(phys);
+
+  struct ksm_node *ksm = tree_find(&stable, hash, phys);
+
+  if (!ksm) {
+    ksm = tree_find(&unstable, hash, phys);
+    if (ksm && !promote(ksm))
+      ksm = NULL;
+  }
+
+  if (!ksm) {
+    ksm = kmem_cache_alloc(node_cache);
+    if (!ksm)
+      return false;
+
+    ksm->hash = hash;
+    ksm->phys = phys;
+    ksm->proc = proc;
+    ksm->virt = virt;
+    tree_insert(&unstable, ksm);
+
+    return false;
+  }
+
+  int flags = write_protect(*pte) & (0x7 | PAGE_COW);
+
+  pmm_page_get(ksm->phys);
+  vmm_cursor_map(cur, virt, ksm->phys, flags, PAGE_SIZE);
+  pmm_page_put(phys);
+
+  return true;
+}
+
+/* let go of frames nobody maps anymore */
+static void prune_stable() {
+  struct rb_node *next;
+
+  for (struct rb_node *node = rb_first(&stable); node; node = next) {
+    struct ksm_node *ksm = node_entry(node);
+    struct page *page = pmm_page(ksm->phys);
+
+    next = rb_next(node);
+
+    if (page->refcount > 1)
+      continue;
+
+    page->flags &= ~PG_KSM;
+    rb_erase(node, &stable);
+    pmm_page_put(ksm->phys);
+    kmem_cache_free(node_cache, ksm);
+  }
+}
+
+static void clear_unstable() {
+  struct rb_node *node;
+
+  while ((node = rb_first(&unstable))) {
+    rb_erase(node, &unstable);
+    kmem_cache_free(node_cache, node_entry(node));
+  }
+}
+
+struct scan_ctx {
+  u64 scanned;
+  u64 merged;
+};
+
+static int scan_page(ProcessControlBlock *proc, VASRangeNode *range,
+                     struct vmm_cursor *cur, uintptr_t virt, uintptr_t *pte,
+                     void *ctx) {
+  struct scan_ctx *sc = ctx;
+  int did = ++sc->scanned == KSM_SCAN_BATCH ? VMM_WALK_STOP : 0;
+  (void)range;
+
+  // already shared, with a stable frame or after a fork
+  struct page *page = pmm_page(*pte & PAGE_ADDR_MASK);
+  if (!page || page->refcount != 1 || page->mapcount != 1)
+    return did;
+
+  // writes have to set the dirty bit again, and merged pages are
+  // read-only now
+  if (*pte & PAGE_DIRTY)
+    *pte &= ~(uintptr_t)PAGE_DIRTY;
+  else if (merge_page(proc, cur, virt, pte))
+    sc->merged++;
+
+  return did | VMM_WALK_CHANGED;
+}
+
+/*
+ * Look at the next KSM_SCAN_BATCH pages, a pass over every process takes
+ * as many calls as it needs. Returns how many pages were merged.
+ */
+u64 ksm_scan() {
+  struct scan_ctx sc = {.scanned = 0, .merged = 0};
+
+  if (!hand.proc) {
+    u64 flags = irq_save();
+    prune_stable();
+    irq_restore(flags);
+  }
+
+  if (vmm_walk_anon(&hand, scan_page, &sc)) {
+    u64 flags = irq_save();
+    clear_unstable();
+    irq_restore(flags);
+  }
+
+  merges += sc.merged;
+  if (sc.merged) {
+    struct ksm_stats stats;
+    ksm_get_stats(&stats);
+
+    kprintf("[KSM]  Merged %llu pages, %llu frames shared by %llu "
+            "(%llu merges, %llu unmerges)\n",
+            sc.merged, stats.pages_shared, stats.pages_sharing, stats.merges,
+            stats.unmerges);
+  }
+
+  return sc.merged;
+}
+
+/* a write fault copied a merged page */
+void ksm_count_unmerge() {
+  __atomic_add_fetch(&unmerges, 1, __ATOMIC_RELAXED);
+}
+
+void ksm_get_stats(struct ksm_stats *stats) {
+  u64 flags = irq_save();
+
+  stats->pages_shared = 0;
+  stats->pages_sharing = 0;
+
+  for (struct rb_node *node = rb_first(&stable); node; node = rb_next(node)) {
+    stats->pages_shared++;
+    stats->pages_sharing += pmm_page(node_entry(node)->phys)->mapcount;
+  }
+
+  stats->merges = merges;
+  stats->unmerges = __atomic_load_n(&unmerges, __ATOMIC_RELAXED);
+
+  irq_restore(flags);
+}
+
+void ksm_init() {
+  node_cache = kmem_cache_create("ksm_node", sizeof(struct ksm_node), 0,
+                                 NULL, NULL);
+}
+
+void ksm_proc() {
+  for (;;) {
+    proc_sleep(KSM_SCAN_INTERVAL);
+    ksm_scan();
+  }
+}
@@ -1,191 +1,588 @@
 #include <stddef.h>
+#include <sys/queue.h>
 
+#include <config.h>
+#include <cpu/cpu.h>
+#include <cpu/numa.h>
 #include <libk/kprintf.h>
+#include <libk/spinlock.h>
 #include <libk/util.h>
+#include <memory/compact.h>
 #include <memory/pmm.h>
+#include <memory/slab.h>
 #include <memory/vmm.h>
 #include <stivale2.h>
 #include <string/string.h>
 
-u64 total_blocks = PMM_MAX_BITMAPS * PMM_BLOCKS_PER_BYTE;
-u64 total_bmaps;
+/*
+ * Binary buddy allocator.
+ *
+ * Free blocks of 2^order pages are kept on per-order lists, the list
+ * node lives in the first page of the free block itself (accessed through
+ * the higher half direct map). The mmap[] bitmap still records whether a
+ * page is used, which is what tells us if a buddy can be merged. It is
+ * sized from the boot memory map and lives at the start of the first
+ * usable region that is big enough to hold it, followed by page_db[], one
+ * struct page per pfn. A page's refcount is 1 while it is allocated and 0
+ * while it sits in the buddy lists or a per-cpu cache.
+ *
+ * Memory is split into zones per numa node: DMA (below 16 MiB), DMA32
+ * (below 4 GiB) and Normal. Each zone has its own free lists and buddies
+ * never merge across zones. Allocations try the local node first and only
+ * fall back to DMA when nothing else is left.
+ *
+ * Single pages go through small per-cpu caches first. They are refilled
+ * from and drained to the buddy lists in batches, so the global lock is
+ * only taken once every PMM_PCP_BATCH allocations or frees.
+ */
+
+struct buddy_block {
+  LIST_ENTRY(buddy_block) entries;
+  u64 order;
+};
+
+LIST_HEAD(buddy_list, buddy_block);
+
+struct buddy_block_area {
+  struct buddy_list blocks;
+  u64 count;
+};
+
+struct pmm_zone {
+  struct buddy_block_area free_area[PMM_MAX_ORDER + 1];
+  u64 free; /* blocks on the free lists */
+};
+
+static struct pmm_zone zones[MAX_NUMA_NODES][ZONE_COUNT];
+static const char *zone_names[ZONE_COUNT] = {"DMA", "DMA32", "Normal"};
+
+u64 total_blocks;
+u64 total_bmaps; /* number of 64 bit words in mmap[] */
 u64 free_blocks;
 u64 used_blocks;
-u64 last_checked_block = 1;
-u8 mmap[PMM_MAX_BITMAPS]; /* max maps for a 64 GiB memory space (takes 2 KiB) */
+u64 *mmap;
+static struct page *page_db;
 
-static void set_frame_used(u64 block) {
-  u64 index = block / 8;
-  mmap[index] |= (1 << (block % 8));
-  return;
-}
+/* per-cpu hot page cache, pages are chained through their first word */
+struct pmm_pcp {
+  uintptr_t *pages;
+  u64 count;
+};
 
-static void set_frame_free(u64 block) {
-  u64 index = block / 8;
-  mmap[index] &= ~(1 << (block % 8));
-  return;
-}
+static struct pmm_pcp pcp[MAX_CORES];
+static Spinlock pmm_lock = SPINLOCK_INIT;
 
 static bool is_block_used(u64 block) {
   // 1 if used; 0 if free
-  u64 index = block / 8;
-  return mmap[index] & (1 << (block % 8));
+  return mmap[block / 64] & (1ull << (block % 64));
 }
 
-static bool is_block_free(u64 block) { return !is_block_used(block); }
+/* set or clear a run of bits, a whole word at a time where possible */
+static void bitmap_fill(u64 block, u64 count, bool used) {
+  u64 end = block + count;
+
+  while (block < end && block % 64) {
+    if (used)
+      mmap[block / 64] |= (1ull << (block % 64));
+    else
+      mmap[block / 64] &= ~(1ull << (block % 64));
+    block++;
+  }
+
+  for (; block + 64 <= end; block += 64)
+    mmap[block / 64] = used ? ~0ull : 0;
 
-static void pmm_mark_region_used(void *start_addr, void *end_addr) {
+  for (; block < end; block++) {
+    if (used)
+      mmap[block / 64] |= (1ull << (block % 64));
+    else
+      mmap[block / 64] &= ~(1ull << (block % 64));
+  }
+}
 
-  u64 start_block = (u64)start_addr / PMM_BLOCK_SIZE;
-  u64 end_block = ((u64)end_addr / PMM_BLOCK_SIZE) + 1;
+/* first block at or after `block` whose used bit is `used` */
+static u64 bitmap_next(u64 block, bool used) {
+  while (block < total_blocks) {
+    u64 word = used ? mmap[block / 64] : ~mmap[block / 64];
+    word &= ~0ull << (block % 64);
 
-  kprintf("[PMM]  Marking blocks from 0x%x to 0x%x as used\n",
-          start_block * PMM_BLOCK_SIZE, end_block * PMM_BLOCK_SIZE);
+    if (word)
+      return (block & ~63ull) + __builtin_ctzll(word);
 
-  for (u64 block = start_block; block < end_block; ++block) {
-    set_frame_used(block);
-    --free_blocks;
-    ++used_blocks;
+    block = (block & ~63ull) + 64;
   }
+  return total_blocks;
+}
 
-  return;
+static struct buddy_block *block_header(u64 block) {
+  return (struct buddy_block *)(PAGING_VIRTUAL_OFFSET +
+                                block * PMM_BLOCK_SIZE);
+}
+
+static u8 zone_type(u64 block) {
+  if (block < ZONE_DMA_END / PMM_BLOCK_SIZE)
+    return ZONE_DMA;
+  if (block < ZONE_DMA32_END / PMM_BLOCK_SIZE)
+    return ZONE_DMA32;
+  return ZONE_NORMAL;
+}
+
+static struct pmm_zone *zone_of(u64 block) {
+  return &zones[numa_node_of(block * PMM_BLOCK_SIZE)][zone_type(block)];
+}
+
+/*
+ * Zones an allocation may come from, in the order they should be tried.
+ * `max_zone` is the highest zone the caller can use. The local node goes
+ * first and DMA is kept as a last resort unless it was asked for.
+ */
+static u8 zonelist(struct pmm_zone **list, u8 max_zone, u8 node) {
+  u8 nodes = numa_node_count(), count = 0;
+
+  for (u8 n = 0; n < nodes; n++)
+    for (int type = max_zone; type > ZONE_DMA; type--)
+      list[count++] = &zones[(node + n) % nodes][type];
+
+  for (u8 n = 0; n < nodes; n++)
+    list[count++] = &zones[(node + n) % nodes][ZONE_DMA];
+
+  return count;
+}
+
+static u8 order_from_count(u64 blocks) {
+  u8 order = 0;
+  while ((1ull << order) < blocks)
+    order++;
+  return order;
+}
+
+static void buddy_push(u64 block, u8 order) {
+  struct pmm_zone *zone = zone_of(block);
+  struct buddy_block *hdr = block_header(block);
+  hdr->order = order;
+  LIST_INSERT_HEAD(&zone->free_area[order].blocks, hdr, entries);
+  zone->free_area[order].count++;
+  zone->free += 1ull << order;
+}
+
+static void buddy_remove(u64 block, u8 order) {
+  struct pmm_zone *zone = zone_of(block);
+  LIST_REMOVE(block_header(block), entries);
+  zone->free_area[order].count--;
+  zone->free -= 1ull << order;
 }
 
-static void pmm_init_region(void *addr, u64 size) {
+/* buddy is free and not split into smaller blocks */
+static bool buddy_is_free(u64 buddy, u8 order) {
+  if (buddy + (1ull << order) > total_blocks)
+    return false;
+
+  if (is_block_used(buddy))
+    return false;
+
+  return block_header(buddy)->order == order;
+}
 
-  kprintf("[PMM]  Address: 0x%x with size: %llu bytes.\n", addr, size);
+static void buddy_free_order(u64 block, u8 order) {
+  struct pmm_zone *zone = zone_of(block);
 
-  u64 start_frame = ((u64)addr) / PMM_BLOCK_SIZE;
-  u64 end_frame = start_frame + (size / PMM_BLOCK_SIZE);
+  while (order < PMM_MAX_ORDER) {
+    u64 buddy = block ^ (1ull << order);
+    if (!buddy_is_free(buddy, order) || zone_of(buddy) != zone)
+      break;
 
-  for (u64 i = start_frame; i < end_frame; i++) {
-    set_frame_free(i);
-    ++free_blocks;
-    --used_blocks;
+    buddy_remove(buddy, order);
+    block &= ~(1ull << order);
+    order++;
   }
 
-  kprintf("[PMM]  Free Blocks: %lu\n", free_blocks);
-  kprintf("[PMM]  Used Blocks: %lu\n\n", used_blocks);
+  buddy_push(block, order);
+}
 
-  return;
+/*
+ * Return an arbitrary run of used blocks to the free lists, split into the
+ * largest naturally aligned power of two chunks. Blocks are only marked
+ * free once their chunk is on a list so buddy checks never see a free
+ * block without a valid header.
+ */
+static void buddy_free_range(u64 block, u64 count) {
+  while (count) {
+    u8 order = PMM_MAX_ORDER;
+    while (order && ((block & ((1ull << order) - 1)) ||
+                     (1ull << order) > count))
+      order--;
+
+    bitmap_fill(block, 1ull << order, false);
+
+    buddy_free_order(block, order);
+    block += 1ull << order;
+    count -= 1ull << order;
+  }
 }
 
-static int pmm_get_first_free() {
-  for (; last_checked_block < total_blocks; last_checked_block++) {
-    // check if frame index is free
-    if (!is_block_used(last_checked_block)) {
-      last_checked_block++;
-      return last_checked_block - 1;
+static u64 buddy_alloc_order(struct pmm_zone *zone, u8 order) {
+  u8 cur = order;
+  while (cur <= PMM_MAX_ORDER && LIST_EMPTY(&zone->free_area[cur].blocks))
+    cur++;
+
+  if (cur > PMM_MAX_ORDER)
+    return PMM_NO_BLOCK;
+
+  struct buddy_block *hdr = LIST_FIRST(&zone->free_area[cur].blocks);
+  u64 block = ((u64)hdr - PAGING_VIRTUAL_OFFSET) / PMM_BLOCK_SIZE;
+  buddy_remove(block, cur);
+
+  // split off the upper halves until we reach the requested order
+  while (cur > order) {
+    cur--;
+    buddy_push(block + (1ull << cur), cur);
+  }
+
+  return block;
+}
+
+/*
+ * Requests larger than the biggest buddy order are served by looking for
+ * consecutive free max order blocks, starting on an `align` boundary.
+ * This only happens for a few large boot time buffers and 1 GiB pages so
+ * a linear walk over max order chunks is fine.
+ */
+static u64 buddy_alloc_giant(struct pmm_zone *zone, u64 blocks, u64 align) {
+  const u64 chunk = 1ull << PMM_MAX_ORDER;
+  u64 needed = DIV_ROUND_UP(blocks, chunk);
+  u64 run_start = 0, run = 0;
+
+  if (zone->free < blocks)
+    return PMM_NO_BLOCK;
+
+  for (u64 block = 0; block + chunk <= total_blocks; block += chunk) {
+    if (!buddy_is_free(block, PMM_MAX_ORDER) || zone_of(block) != zone) {
+      run = 0;
+      continue;
+    }
+
+    if (run == 0 && block % align)
+      continue;
+
+    if (run++ == 0)
+      run_start = block;
+
+    if (run == needed) {
+      for (u64 i = 0; i < needed; i++)
+        buddy_remove(run_start + i * chunk, PMM_MAX_ORDER);
+      return run_start;
     }
   }
-  last_checked_block = 1;
-  return -1;
-}
-
-static int pmm_get_first_free_chunk(u64 blocks) {
-  for (; last_checked_block < total_blocks; last_checked_block++) {
-    if (mmap[last_checked_block / 8] != 0xff) {
-      for (u8 i = 0; i < 8; i++) {
-        u64 start_idx = last_checked_block * 8 + i;
-        if (start_idx == total_blocks - 1)
-          return -1;
-        // found free block
-        if (!is_block_used(start_idx)) {
-          u64 free = 0;
-          for (u64 j = start_idx; j <= (start_idx + blocks); j++) {
-            // used
-            if (is_block_used(j)) {
-              start_idx++;
-              break;
-            } else
-              free++;
-            if (free == blocks)
-              return start_idx;
-          }
-        } else
-          start_idx++;
-      }
+
+  return PMM_NO_BLOCK;
+}
+
+/* caller holds pmm_lock */
+static u64 buddy_alloc_blocks(u64 size, u8 max_zone, u8 node) {
+  struct pmm_zone *list[MAX_NUMA_NODES * ZONE_COUNT];
+  u8 count = zonelist(list, max_zone, node);
+
+  u64 sb = PMM_NO_BLOCK, reserved = 0;
+  for (u8 i = 0; i < count && sb == PMM_NO_BLOCK; i++) {
+    if (list[i]->free < size)
+      continue;
+
+    if (size > (1ull << PMM_MAX_ORDER)) {
+      sb = buddy_alloc_giant(list[i], size, 1);
+      reserved = ALIGN_UP(size, 1ull << PMM_MAX_ORDER);
+    } else {
+      u8 order = order_from_count(size);
+      sb = buddy_alloc_order(list[i], order);
+      reserved = 1ull << order;
     }
   }
 
-  last_checked_block = 1;
-  return -1;
+  if (sb == PMM_NO_BLOCK)
+    return PMM_NO_BLOCK; // ran out of usable mem
+
+  bitmap_fill(sb, reserved, true);
+
+  // give back the tail we don't need
+  if (reserved > size)
+    buddy_free_range(sb + size, reserved - size);
+
+  used_blocks += size;
+  free_blocks -= size;
+
+  return sb;
 }
 
-void *pmm_alloc_blocks(size_t size) {
-  int sb = pmm_get_first_free_chunk(size);
+/* caller holds pmm_lock */
+static void buddy_free_blocks(u64 sb, u64 blocks) {
+  buddy_free_range(sb, blocks);
+
+  used_blocks -= blocks;
+  free_blocks += blocks;
+}
+
+static void pcp_push(struct pmm_pcp *cache, u64 block) {
+  uintptr_t *page = (uintptr_t *)block_header(block);
+  *page = (uintptr_t)cache->pages;
+  cache->pages = page;
+  cache->count++;
+}
 
-  if (sb == -1) {
-    /*
-     * do another search beginning at frame 1
-     * to make sure no frames are left free
-     */
-    last_checked_block = 1;
-    sb = pmm_get_first_free();
-    if (sb == -1)
-      return 0x0; // ran out of usable mem
+static u64 pcp_pop(struct pmm_pcp *cache) {
+  uintptr_t *page = cache->pages;
+  cache->pages = (uintptr_t *)*page;
+  cache->count--;
+  return ((uintptr_t)page - PAGING_VIRTUAL_OFFSET) / PMM_BLOCK_SIZE;
+}
+
+static void pcp_refill(struct pmm_pcp *cache) {
+  spin_lock(&pmm_lock);
+  for (int i = 0; i < PMM_PCP_BATCH; i++) {
+    u64 block = buddy_alloc_blocks(1, ZONE_NORMAL, cpu_current_node());
+    if (block == PMM_NO_BLOCK)
+      break;
+    pcp_push(cache, block);
   }
+  spin_unlock(&pmm_lock);
+}
+
+static void pcp_drain(struct pmm_pcp *cache, u64 count) {
+  spin_lock(&pmm_lock);
+  while (count-- && cache->count)
+    buddy_free_blocks(pcp_pop(cache), 1);
+  spin_unlock(&pmm_lock);
+}
 
-  u64 addr = sb * PMM_BLOCK_SIZE;
+/* fresh metadata for a run of pages entering or leaving the allocator */
+static void page_reset(u64 block, u64 count, u32 refcount) {
+  for (u64 b = block; b < block + count; b++)
+    page_db[b] = (struct page){.refcount = refcount};
+}
+
+static void *pmm_alloc(size_t size, u8 max_zone, u8 node) {
+  if (size == 0)
+    return 0x0;
+
+  u64 flags = irq_save();
+  spin_lock(&pmm_lock);
+  u64 sb = buddy_alloc_blocks(size, max_zone, node);
+  spin_unlock(&pmm_lock);
 
-  for (u64 b = sb; b < (sb + size); ++b) {
-    set_frame_used(b);
+  if (sb == PMM_NO_BLOCK) {
+    /* cached pages may be what is keeping buddies from merging */
+    struct pmm_pcp *cache = &pcp[cpu_current_id()];
+    pcp_drain(cache, cache->count);
+
+    spin_lock(&pmm_lock);
+    sb = buddy_alloc_blocks(size, max_zone, node);
+    spin_unlock(&pmm_lock);
   }
+  irq_restore(flags);
 
-  used_blocks += size;
-  free_blocks -= size;
+  // the slab allocator may be sitting on empty slabs
+  if (sb == PMM_NO_BLOCK && kmem_reap(true))
+    return pmm_alloc(size, max_zone, node);
+
+  if (sb == PMM_NO_BLOCK)
+    return 0x0; // ran out of usable mem
+
+  page_reset(sb, size, 1);
+  return (void *)(sb * PMM_BLOCK_SIZE);
+}
+
+void *pmm_alloc_blocks(size_t size) {
+  if (size == 1)
+    return pmm_alloc_block();
+
+  return pmm_alloc(size, ZONE_NORMAL, cpu_current_node());
+}
+
+/* for devices that can only address memory below the end of `zone` */
+void *pmm_alloc_blocks_zone(size_t size, u8 zone) {
+  if (size == 1 && zone == ZONE_NORMAL)
+    return pmm_alloc_block();
 
-  return (void *)addr;
+  return pmm_alloc(size, zone, cpu_current_node());
+}
+
+/* prefer memory on `node`, falling back to the other nodes */
+void *pmm_alloc_blocks_node(size_t size, u8 node) {
+  if (node >= numa_node_count())
+    node = 0;
+
+  return pmm_alloc(size, ZONE_NORMAL, node);
 }
 
 void *pmm_alloc_block() {
-  int block = pmm_get_first_free();
-
-  if (block == -1) {
-    /*
-     * do another search beginning at frame 1
-     * to make sure no frames are left free
-     */
-    last_checked_block = 1;
-    block = pmm_get_first_free();
-    if (block == -1) {
-      return 0x0; // ran out of usable mem
-    }
-  }
+  u64 flags = irq_save();
+  struct pmm_pcp *cache = &pcp[cpu_current_id()];
 
-  u64 addr = block * PMM_BLOCK_SIZE;
+  if (cache->count <= PMM_PCP_LOW)
+    pcp_refill(cache);
 
-  // set block used
-  set_frame_used(block);
+  void *addr = 0x0;
+  if (cache->count) {
+    u64 block = pcp_pop(cache);
+    page_reset(block, 1, 1);
+    addr = (void *)(block * PMM_BLOCK_SIZE);
+  }
+
+  irq_restore(flags);
 
-  used_blocks++;
-  free_blocks--;
+  if (!addr && kmem_reap(true))
+    return pmm_alloc_block();
 
-  return (void *)(addr);
+  return addr;
 }
 
-// TODO
 void pmm_free_blocks(uintptr_t addr, u64 blocks) {
-  int sb = addr / PMM_BLOCK_SIZE;
+  if (blocks == 1) {
+    pmm_free_block(addr);
+    return;
+  }
 
-  for (u64 b = sb; b < (sb + blocks); ++b)
-    set_frame_free(b);
+  page_reset(addr / PMM_BLOCK_SIZE, blocks, 0);
 
-  used_blocks += blocks;
-  free_blocks -= blocks;
+  u64 flags = irq_save();
+  spin_lock(&pmm_lock);
+  buddy_free_blocks(addr / PMM_BLOCK_SIZE, blocks);
+  spin_unlock(&pmm_lock);
+  irq_restore(flags);
 }
 
 void pmm_free_block(uintptr_t addr) {
-  int block = addr / PMM_BLOCK_SIZE;
+  u64 flags = irq_save();
+  struct pmm_pcp *cache = &pcp[cpu_current_id()];
 
-  set_frame_free(block);
+  page_reset(addr / PMM_BLOCK_SIZE, 1, 0);
+  pcp_push(cache, addr / PMM_BLOCK_SIZE);
 
-  used_blocks--;
-  free_blocks++;
-  return;
+  if (cache->count >= PMM_PCP_HIGH)
+    pcp_drain(cache, PMM_PCP_BATCH);
+
+  irq_restore(flags);
+}
+
+void *pmm_alloc_huge(u8 order) {
+  u64 sb = PMM_NO_BLOCK;
+  u64 blocks = 1ull << order;
+
+  struct pmm_zone *list[MAX_NUMA_NODES * ZONE_COUNT];
+  u8 count = zonelist(list, ZONE_NORMAL, cpu_current_node());
+
+  u64 flags = irq_save();
+  spin_lock(&pmm_lock);
+  for (u8 i = 0; i < count && sb == PMM_NO_BLOCK; i++) {
+    if (order <= PMM_MAX_ORDER)
+      sb = buddy_alloc_order(list[i], order);
+    else
+      sb = buddy_alloc_giant(list[i], blocks, blocks);
+  }
+
+  if (sb != PMM_NO_BLOCK) {
+    bitmap_fill(sb, blocks, true);
+    used_blocks += blocks;
+    free_blocks -= blocks;
+  }
+  spin_unlock(&pmm_lock);
+  irq_restore(flags);
+
+  if (sb == PMM_NO_BLOCK && order == PMM_ORDER_2M) {
+    void *addr = compact_alloc_2m();
+    if (addr)
+      page_reset((uintptr_t)addr / PMM_BLOCK_SIZE, blocks, 1);
+    return addr;
+  }
+
+  if (sb == PMM_NO_BLOCK)
+    return 0x0;
+
+  page_reset(sb, blocks, 1);
+  return (void *)(sb * PMM_BLOCK_SIZE);
+}
+
+void pmm_free_huge(uintptr_t addr, u8 order) {
+  pmm_free_blocks(addr, 1ull << order);
+}
+
+void pmm_drain_cache() {
+  u64 flags = irq_save();
+  struct pmm_pcp *cache = &pcp[cpu_current_id()];
+  pcp_drain(cache, cache->count);
+  irq_restore(flags);
+}
+
+u64 pmm_count_used(uintptr_t addr, u64 blocks) {
+  u64 used = 0;
+  u64 sb = addr / PMM_BLOCK_SIZE;
+
+  for (u64 b = sb; b < sb + blocks && b < total_blocks; b++)
+    used += is_block_used(b);
+
+  return used;
+}
+
+/*
+ * Pull every free block inside the range off the free lists and mark it
+ * used, so nothing else can be allocated from it while it is compacted.
+ * The range must be aligned to a power of two size with no free block
+ * larger than the range covering it.
+ */
+void pmm_isolate(uintptr_t addr, u64 blocks) {
+  u64 block = addr / PMM_BLOCK_SIZE;
+  u64 end = block + blocks;
+  u64 isolated = 0;
+
+  u64 flags = irq_save();
+  spin_lock(&pmm_lock);
+  while ((block = bitmap_next(block, false)) < end) {
+    u8 order = block_header(block)->order;
+
+    buddy_remove(block, order);
+    bitmap_fill(block, 1ull << order, true);
+    isolated += 1ull << order;
+    block += 1ull << order;
+  }
+
+  used_blocks += isolated;
+  free_blocks -= isolated;
+  spin_unlock(&pmm_lock);
+  irq_restore(flags);
+}
+
+/* NULL for anything the allocator doesn't manage, e.g. mmio */
+struct page *pmm_page(uintptr_t addr) {
+  u64 block = addr / PMM_BLOCK_SIZE;
+  if (block >= total_blocks || (page_db[block].flags & PG_RESERVED))
+    return NULL;
+
+  return &page_db[block];
+}
+
+void pmm_page_get(uintptr_t addr) {
+  struct page *page = pmm_page(addr);
+  if (page)
+    __atomic_add_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL);
+}
+
+/* drop a reference, the page goes back to the allocator with the last one */
+void pmm_page_put(uintptr_t addr) {
+  struct page *page = pmm_page(addr);
+  if (!page)
+    return;
+
+  if (__atomic_sub_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    pmm_free_block(addr & ~(uintptr_t)(PMM_BLOCK_SIZE - 1));
 }
 
-u64 pmm_get_free_block_count() { return free_blocks; }
+/* pages sitting in the per-cpu caches are still free to use */
+static u64 pcp_block_count() {
+  u64 count = 0;
+  for (int i = 0; i < MAX_CORES; i++)
+    count += pcp[i].count;
+  return count;
+}
+
+u64 pmm_get_free_block_count() { return free_blocks + pcp_block_count(); }
 
 u64 pmm_get_block_count() { return total_blocks; }
 
@@ -195,38 +592,150 @@ void pmm_dump() {
   kprintf("[PMM]  %lu total blocks\n", total_blocks);
   kprintf("[PMM]  %lu free blocks\n", free_blocks);
   kprintf("[PMM]  %lu used blocks\n", used_blocks);
+  kprintf("[PMM]  %lu blocks in per-cpu caches\n", pcp_block_count());
+
+  for (u8 node = 0; node < numa_node_count(); node++) {
+    for (u8 type = 0; type < ZONE_COUNT; type++) {
+      struct pmm_zone *zone = &zones[node][type];
+      if (!zone->free)
+        continue;
+
+      kprintf("[PMM]  node %u %s: %lu free blocks, by order:", node,
+              zone_names[type], zone->free);
+      for (u8 order = 0; order <= PMM_MAX_ORDER; order++)
+        kprintf(" %lu", zone->free_area[order].count);
+      kprintf("\n");
+    }
+  }
 
-  for (u64 i = 0; i < total_blocks; i++) {
-    if (is_block_used(i))
-      kprintf("Block #%d; Addr: 0x%x; Status: Used\n", i, i * PMM_BLOCK_SIZE);
-    else
-      kprintf("Block #%d; Addr: 0x%x; Status: Free\n", i, i * PMM_BLOCK_SIZE);
+  u64 slab = 0, pagetable = 0, shared = 0, mapped = 0;
+  for (u64 b = 0; b < total_blocks; b++) {
+    slab += !!(page_db[b].flags & PG_SLAB);
+    pagetable += !!(page_db[b].flags & PG_PAGETABLE);
+    shared += page_db[b].refcount > 1;
+    mapped += page_db[b].mapcount > 0;
+  }
+  kprintf("[PMM]  %lu slab, %lu page table, %lu mapped, %lu shared blocks\n",
+          slab, pagetable, mapped, shared);
+
+  for (u64 start = 0; start < total_blocks;) {
+    bool used = is_block_used(start);
+    u64 end = bitmap_next(start, !used);
+
+    kprintf("[PMM]  0x%llx - 0x%llx %s (%llu blocks)\n",
+            start * PMM_BLOCK_SIZE, end * PMM_BLOCK_SIZE,
+            used ? "Used" : "Free", end - start);
+    start = end;
   }
 }
 
+static void pmm_init_region(u64 base, u64 length) {
+
+#ifdef PMM_DEBUG
+  kprintf("[PMM]  Address: 0x%llx with size: %llu bytes.\n", base, length);
+#endif
+
+  u64 start_frame = ALIGN_UP(base, PMM_BLOCK_SIZE) / PMM_BLOCK_SIZE;
+  u64 end_frame = (base + length) / PMM_BLOCK_SIZE;
+
+  /* the first 1MiB stays reserved */
+  if (start_frame < 256)
+    start_frame = 256;
+
+  if (start_frame >= end_frame)
+    return;
+
+  for (u64 b = start_frame; b < end_frame; b++)
+    page_db[b].flags &= ~PG_RESERVED;
+
+  buddy_free_range(start_frame, end_frame - start_frame);
+
+  free_blocks += end_frame - start_frame;
+  used_blocks -= end_frame - start_frame;
+
+  return;
+}
+
 void pmm_init(struct stivale2_struct_tag_memmap *meminfo) {
 
-  total_bmaps = total_blocks / PMM_BLOCKS_PER_BYTE;
+  /* the bitmap only has to reach the end of the highest usable entry */
+  u64 top = 0;
+  for (u64 i = 0; i < meminfo->entries; ++i) {
+    struct stivale2_mmap_entry *entry = &meminfo->memmap[i];
+    if (entry->type == STIVALE2_MMAP_USABLE &&
+        entry->base + entry->length > top)
+      top = entry->base + entry->length;
+  }
+
+  total_blocks = top / PMM_BLOCK_SIZE;
+  total_bmaps = DIV_ROUND_UP(total_blocks, 64);
+
+  u64 bitmap_size = ALIGN_UP(total_bmaps * sizeof(u64), PMM_BLOCK_SIZE);
+  u64 page_db_size =
+      ALIGN_UP(total_blocks * sizeof(struct page), PMM_BLOCK_SIZE);
+  u64 meta_size = bitmap_size + page_db_size;
+  u64 bitmap_base = 0;
+
+  /* keep the metadata out of the DMA zone if at all possible */
+  u64 lowest[2] = {ZONE_DMA_END, 0x100000};
+  for (int pass = 0; pass < 2 && !bitmap_base; pass++) {
+    for (u64 i = 0; i < meminfo->entries; ++i) {
+      struct stivale2_mmap_entry *entry = &meminfo->memmap[i];
+      u64 base = ALIGN_UP(entry->base, PMM_BLOCK_SIZE);
+      if (base < lowest[pass])
+        base = lowest[pass];
+
+      if (entry->type == STIVALE2_MMAP_USABLE &&
+          entry->base + entry->length >= base + meta_size) {
+        bitmap_base = base;
+        break;
+      }
+    }
+  }
+
+  if (!bitmap_base)
+    panic("No usable region big enough for the PMM bitmap");
+
+  mmap = (u64 *)(PAGING_VIRTUAL_OFFSET + bitmap_base);
+  page_db = (struct page *)(PAGING_VIRTUAL_OFFSET + bitmap_base + bitmap_size);
+
+  /* holes, firmware and the kernel image stay reserved */
+  for (u64 b = 0; b < total_blocks; b++)
+    page_db[b] = (struct page){.flags = PG_RESERVED};
+
   used_blocks = total_blocks;
   free_blocks = 0;
 
-  /* set every block to free status */
-  memset((void *)&mmap[0], 0x00, total_bmaps);
+  for (u8 node = 0; node < MAX_NUMA_NODES; node++) {
+    for (u8 type = 0; type < ZONE_COUNT; type++) {
+      for (u8 order = 0; order <= PMM_MAX_ORDER; order++) {
+        LIST_INIT(&zones[node][type].free_area[order].blocks);
+        zones[node][type].free_area[order].count = 0;
+      }
+      zones[node][type].free = 0;
+    }
+  }
+
+  /* everything is used until the memory map says otherwise */
+  memset(mmap, 0xff, total_bmaps * sizeof(u64));
 
   for (u64 i = 0; i < meminfo->entries; ++i) {
-    /* mark region used if memory range is not usable */
-    if (!(meminfo->memmap[i].type == STIVALE2_MMAP_USABLE)) {
-      kprintf("[PMM]  Marking 0x%x to 0x%x as used (pmm_init)\n",
-              (void *)meminfo->memmap[i].base,
-              (void *)(meminfo->memmap[i].base + meminfo->memmap[i].length));
-      pmm_mark_region_used(
-          (void *)meminfo->memmap[i].base,
-          (void *)(meminfo->memmap[i].base + meminfo->memmap[i].length));
+    struct stivale2_mmap_entry *entry = &meminfo->memmap[i];
+    if (entry->type != STIVALE2_MMAP_USABLE)
+      continue;
+
+    u64 base = entry->base, end = entry->base + entry->length;
+
+    /* keep the bitmap and page_db out of the free lists */
+    if (base <= bitmap_base && bitmap_base < end) {
+      pmm_init_region(base, bitmap_base - base);
+      base = bitmap_base + meta_size;
     }
-  }
 
-  /* set first 1MiB as used */
-  for (int i = 0; i < 256; i++) {
-    set_frame_used(i);
+    if (base < end)
+      pmm_init_region(base, end - base);
   }
+
+  kprintf("[PMM]  %llu MiB usable, %llu KiB bitmap and page_db at 0x%llx\n",
+          (free_blocks * PMM_BLOCK_SIZE) >> 20, meta_size >> 10, bitmap_base);
 }
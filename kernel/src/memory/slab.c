@@ -1,177 +1,518 @@
-#include "drivers/tty.h"
-#include "fs/tmpfs.h"
 #include "libk/kprintf.h"
 #include "memory/vmm.h"
 #include <config.h>
 #include <libk/util.h>
 #include <memory/pmm.h>
 #include <memory/slab.h>
+#include <memory/vmalloc.h>
 #include <proc/proc.h>
 #include <string/string.h>
 #include <sys/queue.h>
 
+/*
+ * Slab allocator with a per-cpu magazine layer on top.
+ *
+ * Each cpu holds a loaded and a previous magazine of free objects for
+ * every cache, allocations and frees only touch those in the common case.
+ * When both are exhausted, full or empty magazines are traded with the
+ * cache's depot, and only when the depot has nothing to offer do we fall
+ * through to the slab lists under the cache lock.
+ *
+ * Slabs sit on a full, partial or empty list by how many of their objects
+ * are handed out, allocations come from partial slabs first. Reaping gives
+ * depot magazines back to their slabs and empty slabs back to the pmm.
+ * The "Reaper" process does that periodically for whatever went unused
+ * since its last run, the pmm forces a full reap when it runs dry.
+ */
+
 static struct kmem_cache caches[MAX_KMEM_CACHES];
+static int cache_count = 0;
 
-static struct kmem_slab *slab_create(size_t sz) {
-  void *addr, *end;
-  if (sz < PAGE_SIZE / 8) {
-    addr = pmm_alloc_blocks(2) + PAGING_VIRTUAL_OFFSET;
-    if (!addr)
-      panic("Ran out of physical memory");
-    end = addr + (2 * PAGE_SIZE);
-  } else {
-    addr = pmm_alloc_blocks(8) + PAGING_VIRTUAL_OFFSET;
-    if (!addr)
-      panic("Ran out of physical memory");
-    end = addr + (8 * PAGE_SIZE);
+static struct kmem_cache *mag_cache; // magazines themselves, no magazine layer
+
+/*
+ * kmem_alloc size classes: steps of 8 bytes up to 128, then 8 classes per
+ * power of two (12.5% apart) up to KMEM_MAX_SIZE, 72 in total.
+ */
+#define KMEM_SMALL_CLASSES 16 /* 8, 16, ..., 128 */
+#define KMEM_SIZE_CLASSES (KMEM_SMALL_CLASSES + 7 * 8)
+static struct kmem_cache *size_caches[KMEM_SIZE_CLASSES];
+
+#define KMEM_MIN_ALIGN 8
+#define KMEM_COLOUR_OFF 64 /* cache line */
+#define KMEM_MAX_SLAB_PAGES 32
+
+static inline size_t size_class(size_t sz) {
+  if (sz <= 128)
+    return (sz + 7) / 8 - 1;
+
+  // sz - 1 is in [2^k, 2^(k+1)), its top 4 bits pick one of 8 classes
+  u32 k = 63 - __builtin_clzll(sz - 1);
+  return KMEM_SMALL_CLASSES + (k - 7) * 8 + ((sz - 1) >> (k - 3)) - 8;
+}
+
+static size_t class_size(size_t idx) {
+  if (idx < KMEM_SMALL_CLASSES)
+    return (idx + 1) * 8;
+
+  idx -= KMEM_SMALL_CLASSES;
+  return (9 + idx % 8) << (idx / 8 + 4);
+}
+
+/* smallest slab (in pages) that holds 8 objects or wastes under 1/8 */
+static size_t slab_pages(struct kmem_cache *cp) {
+  size_t head = ALIGN_UP(sizeof(struct kmem_slab), cp->align);
+  size_t pages = 2;
+
+  for (; pages < KMEM_MAX_SLAB_PAGES; pages *= 2) {
+    size_t bytes = pages * PAGE_SIZE - head;
+    size_t count = bytes / cp->stride;
+    if (count >= 8 || (count && (bytes - count * cp->stride) * 8 <= bytes))
+      break;
   }
 
+  return pages;
+}
+
+/* the freelist link of an object */
+static inline void **obj_link(struct kmem_cache *cp, void *obj) {
+  return (void **)(obj + cp->link_off);
+}
+
+static struct kmem_slab *slab_create(struct kmem_cache *cp) {
+  void *addr, *end;
+  size_t pages = cp->slab_pages;
+
+  addr = pmm_alloc_blocks(pages);
+  if (!addr)
+    panic("Ran out of physical memory");
+  addr += PAGING_VIRTUAL_OFFSET;
+  end = addr + (pages * PAGE_SIZE);
+
   struct kmem_slab *slab = (struct kmem_slab *)(addr);
-  size_t offset = ALIGN_UP(sizeof(struct kmem_slab), sz);
 
-  slab->free = addr + offset;
+  for (size_t i = 0; i < pages; i++) {
+    struct page *page = pmm_page((uintptr_t)(addr - PAGING_VIRTUAL_OFFSET) +
+                                 i * PAGE_SIZE);
+    page->flags |= PG_SLAB;
+    page->owner = slab;
+  }
+
+  // offset the objects of consecutive slabs by a cache line or so, so the
+  // same object in different slabs doesn't always land in the same set
+  size_t head = ALIGN_UP(sizeof(struct kmem_slab), cp->align);
+  size_t count = (end - addr - head) / cp->stride;
+  size_t left = (end - addr - head) - count * cp->stride;
+
+  size_t colour = cp->colour_next <= left ? cp->colour_next : 0;
+  cp->colour_next = colour + cp->colour_off;
+
+  void *obj = addr + head + colour;
+  slab->free = obj;
+  slab->objs = obj;
+  slab->total = count;
 
-  uintptr_t *fp = slab->free;
-  while ((void *)fp + sz < end) {
-    *fp = (uintptr_t)((void *)fp + sz);
-    fp = (uintptr_t *)*fp;
+  for (size_t i = 0; i < count; i++, obj += cp->stride) {
+    if (cp->ctor)
+      cp->ctor(obj);
+    *obj_link(cp, obj) = i + 1 < count ? obj + cp->stride : NULL;
   }
-  *fp = 0;
 
   slab->page = slab;
+  slab->cache = cp;
   slab->refcnt = 0;
   slab->boundary = end;
 
   return slab;
 }
 
-struct kmem_cache kmem_cache_create(size_t sz) {
-  if (sz > 2 * PAGE_SIZE)
-    panic("slab allocator: requested size is bigger than 8K, use "
+/*
+ * Create a cache of `size` byte objects aligned to `align` (a power of
+ * two, 0 for the default). Objects are run through `ctor` once when their
+ * slab is created and through `dtor` before it is given back, in between
+ * they must be freed in their constructed state. The freelist link of a
+ * cache with a constructor goes after the object so it never clobbers it.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     size_t align, void (*ctor)(void *),
+                                     void (*dtor)(void *)) {
+  if (size > KMEM_MAX_SIZE)
+    panic("slab allocator: requested size is bigger than 16K, use "
           "pmm_alloc_block ");
 
-  struct kmem_cache cache = {.objsize = sz};
-  LIST_INIT(&cache.slabs);
+  if (cache_count == MAX_KMEM_CACHES)
+    panic("slab allocator: out of caches, bump MAX_KMEM_CACHES");
 
-  struct kmem_slab *new_slab = slab_create(sz);
-  LIST_INSERT_HEAD(&cache.slabs, new_slab, entries);
+  if (align < KMEM_MIN_ALIGN)
+    align = KMEM_MIN_ALIGN;
 
-  return cache;
+  if (align & (align - 1))
+    panic("slab allocator: alignment is not a power of two");
+
+  struct kmem_cache *cp = &caches[cache_count++];
+
+  memset(cp, 0, sizeof(struct kmem_cache));
+  cp->name = name;
+  cp->objsize = size;
+  cp->align = align;
+  cp->ctor = ctor;
+  cp->dtor = dtor;
+
+  cp->link_off = ctor ? ALIGN_UP(size, sizeof(void *)) : 0;
+  cp->stride = ALIGN_UP(ctor ? cp->link_off + sizeof(void *)
+                             : MAX(size, sizeof(void *)),
+                        align);
+  cp->colour_off = MAX(align, KMEM_COLOUR_OFF);
+  cp->slab_pages = slab_pages(cp);
+
+  cp->lock = (Spinlock)SPINLOCK_INIT;
+  LIST_INIT(&cp->slabs_full);
+  LIST_INIT(&cp->slabs_partial);
+  LIST_INIT(&cp->slabs_empty);
+  LIST_INIT(&cp->full);
+  LIST_INIT(&cp->empty);
+
+  kmem_cache_grow(cp);
+  return cp;
 }
 
-static int cache_idx_from_size(size_t sz) {
-  for (int i = 0; i < MAX_KMEM_CACHES; i++)
-    if (caches[i].objsize >= sz) // assume sorted
-      return i;
+static struct kmem_cache *cache_from_size(size_t sz) {
+  if (sz > KMEM_MAX_SIZE)
+    return NULL;
 
-  return -1;
+  return size_caches[size_class(sz ? sz : 1)];
 }
 
 static void dump_slab(struct kmem_slab *slab) {
-  void **fp = slab->free;
+  struct kmem_cache *cp = slab->cache;
+  void *fp = slab->free;
   while (fp) {
-    kprintf("object @ 0x%x; next is @ 0x%x\n", fp, *fp);
-    if (fp == *fp)
+    kprintf("object @ 0x%x; next is @ 0x%x\n", fp, *obj_link(cp, fp));
+    if (fp == *obj_link(cp, fp))
       panic("corrupt freelist in slab \n");
-    fp = *fp;
+    fp = *obj_link(cp, fp);
   }
 }
 
-void *kmem_alloc(size_t sz) {
-  int cache_idx = cache_idx_from_size(sz);
+static void slab_move(struct kmem_slab *slab, struct slab_list *list) {
+  LIST_REMOVE(slab, entries);
+  LIST_INSERT_HEAD(list, slab, entries);
+}
 
-  if (cache_idx == -1) {
-    // size is most likely too large
-    int num_pages = DIV_ROUND_UP(sz, PAGE_SIZE) + 1;
-    void *addr = pmm_alloc_blocks(num_pages);
-    *(size_t *)addr = num_pages;
-    return addr + PAGE_SIZE;
+/* slab layer, caller holds cp->lock */
+static void *slab_alloc(struct kmem_cache *cp) {
+  struct kmem_slab *slab = LIST_FIRST(&cp->slabs_partial);
+
+  if (!slab) {
+    if (!LIST_FIRST(&cp->slabs_empty))
+      kmem_cache_grow(cp);
+
+    slab = LIST_FIRST(&cp->slabs_empty);
+    slab_move(slab, &cp->slabs_partial);
+    cp->empty_slabs--;
+  }
+
+  void *ret = slab->free;
+  slab->free = *obj_link(cp, ret);
+
+  if (++slab->refcnt == slab->total)
+    slab_move(slab, &cp->slabs_full);
+
+  return ret;
+}
+
+/* slab layer, caller holds cp->lock */
+static void slab_free(struct kmem_cache *cp, struct kmem_slab *slab,
+                      void *obj) {
+  *obj_link(cp, obj) = slab->free;
+  slab->free = obj;
+
+  if (slab->refcnt-- == slab->total)
+    slab_move(slab, &cp->slabs_partial);
+
+  if (slab->refcnt == 0) {
+    slab_move(slab, &cp->slabs_empty);
+    cp->empty_slabs++;
+  }
+}
+
+/* give an empty slab's pages back, caller holds cp->lock */
+static void slab_destroy(struct kmem_cache *cp, struct kmem_slab *slab) {
+  LIST_REMOVE(slab, entries);
+  cp->empty_slabs--;
+
+  if (cp->dtor) {
+    void *obj = slab->objs;
+    for (u32 i = 0; i < slab->total; i++, obj += cp->stride)
+      cp->dtor(obj);
+  }
+
+  uintptr_t phys = (uintptr_t)slab->page - (uintptr_t)PAGING_VIRTUAL_OFFSET;
+  u64 pages = (slab->boundary - slab->page) / PAGE_SIZE;
+
+  for (u64 i = 0; i < pages; i++) {
+    struct page *page = pmm_page(phys + i * PAGE_SIZE);
+    page->flags &= ~PG_SLAB;
+    page->owner = NULL;
   }
 
-  struct kmem_cache cache = caches[cache_idx];
+  pmm_free_blocks(phys, pages);
+}
+
+static struct kmem_magazine *mag_alloc() {
+  spin_lock(&mag_cache->lock);
+  struct kmem_magazine *mag = slab_alloc(mag_cache);
+  spin_unlock(&mag_cache->lock);
 
-  if (cache.objsize < sz)
-    panic("allocating from a smaller sized cache");
+  mag->rounds = 0;
+  return mag;
+}
 
-  struct kmem_slab *slab;
-  LIST_FOREACH(slab, &cache.slabs, entries) {
-    if (slab->free != NULL) {
+/*
+ * Hand a magazine's objects back to their slabs and the magazine back to
+ * its cache, caller holds cp->lock. Returns false (and does nothing) if
+ * the magazine cache is busy, which happens when a reap is triggered by
+ * the magazine cache growing.
+ */
+static bool mag_destroy(struct kmem_cache *cp, struct kmem_magazine *mag) {
+  if (!spin_trylock(&mag_cache->lock))
+    return false;
+
+  for (u64 i = 0; i < mag->rounds; i++) {
+    struct page *page = pmm_page((uintptr_t)mag->objs[i] -
+                                 (uintptr_t)PAGING_VIRTUAL_OFFSET);
+    slab_free(cp, page->owner, mag->objs[i]);
+  }
+
+  struct page *page =
+      pmm_page((uintptr_t)mag - (uintptr_t)PAGING_VIRTUAL_OFFSET);
+  slab_free(mag_cache, page->owner, mag);
+
+  spin_unlock(&mag_cache->lock);
+  return true;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cp) {
+  void *obj;
+  u64 flags = irq_save();
+  struct kmem_cpu_cache *cc = &cp->cpu[cpu_current_id()];
+
+  for (;;) {
+    if (cc->loaded && cc->loaded->rounds) {
+      obj = cc->loaded->objs[--cc->loaded->rounds];
       break;
     }
+
+    if (cc->prev && cc->prev->rounds) {
+      struct kmem_magazine *tmp = cc->loaded;
+      cc->loaded = cc->prev;
+      cc->prev = tmp;
+      continue;
+    }
+
+    // both magazines are empty, try to get a full one from the depot
+    spin_lock(&cp->lock);
+    struct kmem_magazine *full = LIST_FIRST(&cp->full);
+    if (full) {
+      LIST_REMOVE(full, entries);
+      cp->full_min = MIN(cp->full_min, --cp->full_mags);
+      if (cc->prev) {
+        LIST_INSERT_HEAD(&cp->empty, cc->prev, entries);
+        cp->empty_mags++;
+      }
+      cc->prev = cc->loaded;
+      cc->loaded = full;
+      spin_unlock(&cp->lock);
+      continue;
+    }
+
+    obj = slab_alloc(cp);
+    spin_unlock(&cp->lock);
+    break;
   }
 
-  if (slab == NULL || slab->free == NULL) {
-    kmem_cache_grow(&caches[cache_idx]);
-    return kmem_alloc(sz);
+  irq_restore(flags);
+  return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *cp, void *buf) {
+  u64 flags = irq_save();
+  struct kmem_cpu_cache *cc = &cp->cpu[cpu_current_id()];
+
+  for (;;) {
+    if (cc->loaded && cc->loaded->rounds < KMEM_MAG_SIZE) {
+      cc->loaded->objs[cc->loaded->rounds++] = buf;
+      break;
+    }
+
+    if (cc->prev && cc->prev->rounds < KMEM_MAG_SIZE) {
+      struct kmem_magazine *tmp = cc->loaded;
+      cc->loaded = cc->prev;
+      cc->prev = tmp;
+      continue;
+    }
+
+    // both magazines are full (or missing), swap in an empty one
+    spin_lock(&cp->lock);
+    struct kmem_magazine *empty = LIST_FIRST(&cp->empty);
+    if (empty) {
+      LIST_REMOVE(empty, entries);
+      cp->empty_min = MIN(cp->empty_min, --cp->empty_mags);
+    } else {
+      spin_unlock(&cp->lock);
+      empty = mag_alloc();
+      spin_lock(&cp->lock);
+    }
+
+    if (cc->prev) {
+      LIST_INSERT_HEAD(&cp->full, cc->prev, entries);
+      cp->full_mags++;
+    }
+    cc->prev = cc->loaded;
+    cc->loaded = empty;
+    spin_unlock(&cp->lock);
   }
 
-  void *ret = slab->free;
-  // kprintf("Current free is 0x%p\n", slab->free);
-  uintptr_t next = *(uintptr_t *)slab->free;
-  // kprintf("Next is %x\n", next);
-  slab->free = *(void **)slab->free;
+  irq_restore(flags);
+}
 
-  return ret;
+void *kmem_alloc(size_t sz) {
+  struct kmem_cache *cp = cache_from_size(sz);
+
+  // too large for any size class, doesn't need contiguous frames either
+  if (!cp)
+    return vmalloc(sz);
+
+  __atomic_add_fetch(&cp->allocs, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&cp->requested, sz, __ATOMIC_RELAXED);
+
+  return kmem_cache_alloc(cp);
 }
 
+/* every slab page points back at its slab */
 static struct kmem_slab *slab_from_ptr(void *ptr) {
-  for (int i = 0; i < MAX_KMEM_CACHES; i++) {
-    // TODO: only checking one slab for now
-    struct kmem_slab *slab;
-    LIST_FOREACH(slab, &caches[i].slabs, entries) {
-      if (ptr >= slab->page && ptr < slab->boundary)
-        return slab;
-    }
-  }
+  struct page *page =
+      pmm_page((uintptr_t)ptr - (uintptr_t)PAGING_VIRTUAL_OFFSET);
+
+  if (!page || !(page->flags & PG_SLAB))
+    return NULL;
 
-  return NULL;
+  return page->owner;
 }
 
 void kmem_free(void *ptr) {
-  struct kmem_slab *slab = slab_from_ptr(ptr);
-
-  if (!slab) {
-    // panic("Trying to free memory from an invalid slab");
-    kprintf("Freeing memory allocated from pmm");
-    size_t *blocks = ptr - PAGE_SIZE;
-    if (*blocks == 0)
-      panic("Freeing 0 blocks...");
+  if (!ptr)
+    return;
 
-    pmm_free_blocks((uintptr_t)ptr - PAGE_SIZE, *blocks);
+  if (is_vmalloc_addr(ptr)) {
+    vfree(ptr);
     return;
   }
 
-  // update free pointer to current free object
-  *(uintptr_t *)(ptr) = (uintptr_t)slab->free;
-  // update current free object to the newly freed object
-  slab->free = ptr;
-}
+  struct kmem_slab *slab = slab_from_ptr(ptr);
+  if (!slab)
+    panic("kmem_free: pointer wasn't returned by kmem_alloc");
 
-void kmem_cache_free(struct kmem_cache *cp, void *buf) {}
+  kmem_cache_free(slab->cache, ptr);
+}
 
 void kmem_cache_grow(struct kmem_cache *cp) {
   struct kmem_slab *new_slab;
-  new_slab = slab_create(cp->objsize);
-  LIST_INSERT_HEAD(&cp->slabs, new_slab, entries);
+  new_slab = slab_create(cp);
+  LIST_INSERT_HEAD(&cp->slabs_empty, new_slab, entries);
+  cp->empty_slabs++;
+}
+
+/*
+ * Release depot magazines and empty slabs. A periodic reap only releases
+ * the magazines that went unused since the last one and keeps a few empty
+ * slabs around, a forced reap releases everything it can. Returns the
+ * number of pages given back to the pmm.
+ */
+u64 kmem_cache_reap(struct kmem_cache *cp, bool force) {
+  u64 freed = 0;
+  u64 flags = irq_save();
+
+  // we may have been called from an allocation that holds this lock
+  if (!spin_trylock(&cp->lock)) {
+    irq_restore(flags);
+    return 0;
+  }
+
+  u64 full = force ? cp->full_mags : cp->full_min;
+  u64 empty = force ? cp->empty_mags : cp->empty_min;
+  struct kmem_magazine *mag;
+
+  while (full-- && (mag = LIST_FIRST(&cp->full))) {
+    LIST_REMOVE(mag, entries);
+    if (!mag_destroy(cp, mag)) {
+      LIST_INSERT_HEAD(&cp->full, mag, entries);
+      break;
+    }
+    cp->full_mags--;
+  }
+
+  while (empty-- && (mag = LIST_FIRST(&cp->empty))) {
+    LIST_REMOVE(mag, entries);
+    if (!mag_destroy(cp, mag)) {
+      LIST_INSERT_HEAD(&cp->empty, mag, entries);
+      break;
+    }
+    cp->empty_mags--;
+  }
+
+  cp->full_min = cp->full_mags;
+  cp->empty_min = cp->empty_mags;
+
+  u64 keep = force ? 0 : KMEM_KEEP_EMPTY;
+  while (cp->empty_slabs > keep) {
+    struct kmem_slab *slab = LIST_FIRST(&cp->slabs_empty);
+    freed += (slab->boundary - slab->page) / PAGE_SIZE;
+    slab_destroy(cp, slab);
+  }
+
+  spin_unlock(&cp->lock);
+  irq_restore(flags);
+
+  return freed;
 }
 
-void kmem_cache_reap(struct kmem_cache *cp, void *buf) {}
+u64 kmem_reap(bool force) {
+  u64 freed = 0;
+
+  for (int i = 0; i < cache_count; i++)
+    freed += kmem_cache_reap(&caches[i], force);
+
+  return freed;
+}
+
+void kmem_reaper_proc() {
+  for (;;) {
+    proc_sleep(KMEM_REAP_INTERVAL);
+    kmem_reap(false);
+  }
+}
 
 void kmem_init() {
+  mag_cache = kmem_cache_create("magazine", sizeof(struct kmem_magazine), 0,
+                                NULL, NULL);
+
+  for (size_t i = 0; i < KMEM_SIZE_CLASSES; i++)
+    size_caches[i] = kmem_cache_create("kmem_alloc", class_size(i), 0, NULL,
+                                       NULL);
+}
 
-  memset(&caches[0], 0, MAX_KMEM_CACHES * sizeof(struct kmem_cache));
-  // powers of 2
-  caches[0] = kmem_cache_create(8);
-  caches[1] = kmem_cache_create(16);
-  caches[2] = kmem_cache_create(32);
-  caches[3] = kmem_cache_create(64);
-  caches[4] = kmem_cache_create(96);
-  caches[5] = kmem_cache_create(128);
-  caches[6] = kmem_cache_create(256);
-  caches[7] = kmem_cache_create(512);
-  caches[8] = kmem_cache_create(1024);
-
-  // kernel structures
-  caches[9] = kmem_cache_create(sizeof(struct tty));
-  caches[10] = kmem_cache_create(sizeof(struct process_control_block));
+/* internal fragmentation of every kmem_alloc size class used so far */
+void kmem_dump() {
+  kprintf("---------------------Slab Information------------------\n");
+
+  for (size_t i = 0; i < KMEM_SIZE_CLASSES; i++) {
+    struct kmem_cache *cp = size_caches[i];
+    if (!cp->allocs)
+      continue;
+
+    u64 handed = cp->allocs * cp->objsize;
+    kprintf("[SLAB] %5lu bytes: %lu allocs, %lu%% wasted\n", cp->objsize,
+            cp->allocs, (handed - cp->requested) * 100 / handed);
+  }
 }
@@ -0,0 +1,63 @@
+#include <libk/kprintf.h>
+#include <memory/thp.h>
+#include <memory/vmm.h>
+#include <proc/proc.h>
+
+/*
+ * Transparent huge pages.
+ *
+ * Anonymous memory is faulted in a 4K page at a time, so a process only
+ * pays for what it touches. The "Collapse" kernel process periodically
+ * looks for 2M aligned stretches of VM_ANON ranges that are fully
+ * populated, copies each into a single 2M page and maps that instead,
+ * cutting the tlb entries needed for big heaps by 512.
+ *
+ * Huge pages go back to 4K pages whenever something needs the finer
+ * granularity: a partial munmap or mprotect, or copy-on-write after fork.
+ */
+
+static u64 collapsed = 0;        // huge pages made so far
+static struct vmm_anon_hand hand; // where the last pass stopped
+
+/* a fully populated 2M stretch starts at a 2M aligned page */
+static int collapse_page(ProcessControlBlock *proc, VASRangeNode *range,
+                         struct vmm_cursor *cur, uintptr_t virt,
+                         uintptr_t *pte, void *ctx) {
+  PageTable *pml4 = (void *)proc->cr3 + PAGING_VIRTUAL_OFFSET;
+  u64 *made = ctx;
+  (void)pte;
+
+  if ((virt & (PAGE_SIZE_2M - 1)) ||
+      virt + PAGE_SIZE_2M > (uintptr_t)range->virt_start + range->size ||
+      !vmm_collapse_huge(pml4, virt))
+    return 0;
+
+  // the table the cursor was in is gone
+  vmm_cursor_init(cur, pml4);
+
+  if (++*made == THP_COLLAPSE_BATCH)
+    return VMM_WALK_CHANGED | VMM_WALK_STOP;
+
+  return VMM_WALK_CHANGED;
+}
+
+/* returns how many huge pages were made, the next call goes on from there */
+u64 thp_collapse() {
+  u64 made = 0;
+
+  vmm_walk_anon(&hand, collapse_page, &made);
+
+  collapsed += made;
+  if (made)
+    kprintf("[THP]  Collapsed %llu huge pages (%llu total)\n", made,
+            collapsed);
+
+  return made;
+}
+
+void thp_proc() {
+  for (;;) {
+    proc_sleep(THP_SCAN_INTERVAL);
+    thp_collapse();
+  }
+}
@@ -0,0 +1,228 @@
+#include <config.h>
+#include <cpu/cpu.h>
+#include <libk/kprintf.h>
+#include <libk/spinlock.h>
+#include <libk/util.h>
+#include <memory/pmm.h>
+#include <memory/slab.h>
+#include <memory/vmalloc.h>
+#include <memory/vmm.h>
+
+/*
+ * Virtually contiguous kernel allocations.
+ *
+ * Large buffers don't need physically contiguous frames, only contiguous
+ * addresses. vmalloc maps single pages from the pmm into a window of the
+ * kernel half, so it succeeds as long as enough free pages exist anywhere.
+ *
+ * The window's pml3 is allocated up front. Every address space copies the
+ * kernel's upper pml4 entries when it is created, so mappings made here
+ * later are visible everywhere without touching other page tables.
+ *
+ * Areas are kept on a list sorted by address and placed first fit, with
+ * an unmapped guard page after each one to catch overruns. Areas of 2 MiB
+ * or more are 2 MiB aligned and use huge pages where the pmm has them.
+ */
+
+struct vm_area {
+  uintptr_t start;
+  size_t pages; /* not counting the guard page */
+  struct vm_area *next;
+};
+
+static struct kmem_cache *vm_area_cache;
+static struct vm_area *areas = NULL;
+static Spinlock vmalloc_lock = SPINLOCK_INIT;
+
+static PageTable *kernel_pml4() {
+  extern PageTable *kernel_cr3;
+  return PAGING_VIRTUAL_OFFSET + (void *)kernel_cr3;
+}
+
+/* unmap and free the first `pages` pages of an area */
+static void area_release(uintptr_t start, size_t pages) {
+  uintptr_t end = start + pages * PAGE_SIZE;
+  struct vmm_cursor cur;
+  size_t size;
+
+  vmm_cursor_init(&cur, kernel_pml4());
+
+  for (uintptr_t virt = start; virt < end; virt += size) {
+    uintptr_t phys = vmm_cursor_unmap(&cur, virt, &size);
+    if (!phys)
+      continue;
+
+    if (size == PAGE_SIZE_2M)
+      pmm_free_huge(phys, PMM_ORDER_2M);
+    else
+      pmm_free_block(phys);
+  }
+}
+
+/* reserve `pages` (plus the guard) in the window, returns 0 when full */
+static uintptr_t area_reserve(struct vm_area *area, size_t pages,
+                              size_t align) {
+  uintptr_t start = VMALLOC_START;
+  struct vm_area **link = &areas;
+
+  for (;; link = &(*link)->next) {
+    start = ALIGN_UP(start, align);
+    if (!*link || ((*link)->start >= start &&
+                   (*link)->start - start >= (pages + 1) * PAGE_SIZE))
+      break;
+    start = (*link)->start + ((*link)->pages + 1) * PAGE_SIZE;
+  }
+
+  if (start >= VMALLOC_END || VMALLOC_END - start < (pages + 1) * PAGE_SIZE)
+    return 0;
+
+  area->start = start;
+  area->pages = pages;
+  area->next = *link;
+  *link = area;
+
+  return start;
+}
+
+static struct vm_area *area_unlink(uintptr_t start) {
+  for (struct vm_area **link = &areas; *link; link = &(*link)->next) {
+    if ((*link)->start == start) {
+      struct vm_area *area = *link;
+      *link = area->next;
+      return area;
+    }
+  }
+
+  return NULL;
+}
+
+void *vmalloc(size_t size) {
+  if (!size)
+    return NULL;
+
+  size_t pages = DIV_ROUND_UP(size, PAGE_SIZE);
+  size_t align = pages >= 512 ? PAGE_SIZE_2M : PAGE_SIZE;
+
+  struct vm_area *area = kmem_cache_alloc(vm_area_cache);
+  if (!area)
+    return NULL;
+
+  u64 flags = irq_save();
+  spin_lock(&vmalloc_lock);
+  uintptr_t start = area_reserve(area, pages, align);
+  spin_unlock(&vmalloc_lock);
+  irq_restore(flags);
+
+  if (!start) {
+    kprintf("[VMALLOC] Window exhausted (%lu pages)\n", pages);
+    kmem_cache_free(vm_area_cache, area);
+    return NULL;
+  }
+
+  // the range is ours now, map it without holding the lock
+  struct vmm_cursor cur;
+  vmm_cursor_init(&cur, kernel_pml4());
+
+  bool huge = align == PAGE_SIZE_2M;
+  for (size_t i = 0; i < pages; i++) {
+    uintptr_t virt = start + i * PAGE_SIZE;
+
+    // whole 2M stretches first try for a huge page, stop asking once the
+    // pmm has none so we don't keep falling into compaction
+    if (huge && pages - i >= 512 && !(virt & (PAGE_SIZE_2M - 1))) {
+      void *phys = pmm_alloc_huge(PMM_ORDER_2M);
+
+      if (phys && vmm_cursor_map(&cur, virt, (uintptr_t)phys,
+                                 PAGE_WRITE | PAGE_PRESENT, PAGE_SIZE_2M)) {
+        for (int j = 0; j < 512; j++)
+          pmm_page((uintptr_t)phys + j * PAGE_SIZE)->flags |= PG_KMEM;
+        i += 511;
+        continue;
+      }
+
+      if (phys)
+        pmm_free_huge((uintptr_t)phys, PMM_ORDER_2M);
+      huge = false;
+    }
+
+    void *phys = pmm_alloc_block();
+    if (!phys) {
+      // pages not mapped yet are skipped by area_release
+      vfree((void *)start);
+      return NULL;
+    }
+
+    pmm_page((uintptr_t)phys)->flags |= PG_KMEM;
+    vmm_cursor_map(&cur, virt, (uintptr_t)phys, PAGE_WRITE | PAGE_PRESENT,
+                   PAGE_SIZE);
+  }
+
+#ifdef VMALLOC_DEBUG
+  kprintf("[VMALLOC] %lu pages at 0x%lx\n", pages, start);
+#endif
+
+  return (void *)start;
+}
+
+void vfree(void *addr) {
+  if (!addr)
+    return;
+
+  u64 flags = irq_save();
+  spin_lock(&vmalloc_lock);
+  struct vm_area *area = area_unlink((uintptr_t)addr);
+  spin_unlock(&vmalloc_lock);
+  irq_restore(flags);
+
+  if (!area)
+    panic("vfree: pointer wasn't returned by vmalloc");
+
+  /*
+   * only this core's tlb is flushed, there is no shootdown yet. Buffers
+   * here are private to whoever allocated them, so other cores should not
+   * be holding translations for them.
+   */
+  area_release(area->start, area->pages);
+
+  kmem_cache_free(vm_area_cache, area);
+}
+
+/* frame behind a vmalloc address, or a plain hhdm one */
+uintptr_t vmalloc_to_phys(void *addr) {
+  if (!is_vmalloc_addr(addr))
+    return (uintptr_t)addr - (uintptr_t)PAGING_VIRTUAL_OFFSET;
+
+  return vmm_virt_to_phys(kernel_pml4(), (uintptr_t)addr);
+}
+
+/* like vmalloc_to_phys, `size` is set to the size of the page it's in */
+uintptr_t vmalloc_to_page(void *addr, size_t *size) {
+  *size = PAGE_SIZE;
+
+  if (!is_vmalloc_addr(addr))
+    return vmalloc_to_phys(addr);
+
+  if (!vmm_get_entry(kernel_pml4(), (uintptr_t)addr, size))
+    *size = PAGE_SIZE;
+
+  return vmalloc_to_phys(addr);
+}
+
+void vmalloc_init() {
+  vm_area_cache =
+      kmem_cache_create("vm_area", sizeof(struct vm_area), 0, NULL, NULL);
+
+  // a throwaway mapping makes vmm allocate the pml3 (and below) for the
+  // window in the kernel's pml4, before any address space copies it
+  void *phys = pmm_alloc_block();
+  if (!phys)
+    panic("vmalloc: no memory for the window's page tables");
+
+  vmm_map_page(kernel_pml4(), VMALLOC_START, (uintptr_t)phys,
+               PAGE_WRITE | PAGE_PRESENT, CACHE_WB);
+  size_t size;
+  vmm_unmap(kernel_pml4(), VMALLOC_START, &size);
+  pmm_free_block((uintptr_t)phys);
+
+  kprintf("[VMALLOC] Window at 0x%lx - 0x%lx\n", VMALLOC_START, VMALLOC_END);
+}
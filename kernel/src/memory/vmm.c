@@ -8,16 +8,54 @@
 #include <memory/slab.h>
 #include <libk/kprintf.h>
 #include <libk/typedefs.h>
+#include <libk/util.h>
+#include <memory/ksm.h>
 #include <memory/pmm.h>
 #include <memory/vmm.h>
+#include <memory/zero.h>
+#include <memory/zswap.h>
 #include <proc/proc.h>
 #include <stivale2.h>
 #include <string/string.h>
 
 extern void load_pagedir(PageTable *);
+extern void invalidate_tlb();
 
 PageTable *kernel_cr3 = NULL;
 
+#define CR0_WP (1 << 16)
+#define CR4_PGE (1 << 7)
+#define CR4_PCIDE (1 << 17)
+#define CR3_NOFLUSH (1ull << 63)
+
+#define CPUID_PGE (1 << 13)  /* edx */
+#define CPUID_PCID (1 << 17) /* ecx */
+#define CPUID_1GB_PAGES (1 << 26) /* edx of leaf 0x80000001 */
+#define CPUID_PAT (1 << 16)  /* edx */
+
+#define MSR_PAT 0x277
+
+/* memory types of PAT entries */
+#define PAT_UC 0x00
+#define PAT_WC 0x01
+#define PAT_WT 0x04
+#define PAT_WP 0x05
+#define PAT_WB 0x06
+#define PAT_UC_MINUS 0x07
+
+#define MAX_PCID 4096
+
+/*
+ * With PCIDs the tlb keeps entries of several address spaces at once, so
+ * switching processes doesn't have to flush. An id's entries belong to
+ * whoever loaded it last, ids are handed out round robin and a process
+ * that finds someone else owned its id since it last ran flushes it.
+ * PCID 0 is the kernel's, only kernel_cr3 is ever loaded with it.
+ */
+static bool pcid_enabled = false;
+static u16 next_pcid = 1;
+static ProcessControlBlock *pcid_owner[MAX_PCID];
+
 static PageIndex vmm_get_page_index(uintptr_t vaddr) {
   PageIndex ret;
 
@@ -29,46 +67,444 @@ static PageIndex vmm_get_page_index(uintptr_t vaddr) {
   return ret;
 }
 
-static uintptr_t *get_next_table(uintptr_t *table, u64 entry) {
-  void *addr;
+/* zeroed page to hold a paging structure */
+static void *alloc_table() {
+  void *addr = zero_alloc_block();
 
-  if (!table)
-    kprintf("NULL table\n");
+  struct page *page = pmm_page((uintptr_t)addr);
+  if (addr && page)
+    page->flags |= PG_PAGETABLE;
 
-  if (table[entry] & PAGE_PRESENT) {
-    addr = (void *)(table[entry] & ~((uintptr_t)0xfff));
-  } else {
-    addr = pmm_alloc_block();
-    memset(PAGING_VIRTUAL_OFFSET + addr, 0, PAGE_SIZE);
+  return addr;
+}
+
+static bool gb_pages = false; // 1 GiB pages are supported
+
+/* replace a 2M/1G entry by a table of the next size down, same mappings */
+static void split_huge(uintptr_t *entry, size_t size) {
+  size_t child = size / 512;
+  uintptr_t phys = *entry & PAGE_ADDR_MASK & ~(size - 1);
+  uintptr_t flags = *entry & 0xfff;
+
+  // in a pte the PS bit means PAT instead
+  if (child == PAGE_SIZE)
+    flags &= ~PAGE_HUGE;
+
+  void *addr = alloc_table();
+  if (!addr)
+    panic("vmm: no memory to split a huge page");
+
+  uintptr_t *table = PAGING_VIRTUAL_OFFSET + addr;
+  for (int i = 0; i < 512; i++)
+    table[i] = (phys + i * child) | flags;
+
+  *entry = (uintptr_t)addr | PAGE_USER | PAGE_WRITE | PAGE_PRESENT;
+}
+
+/* next table down, NULL for a hole or a huge page */
+static uintptr_t *lookup_next_table(uintptr_t *table, u64 entry) {
+  if (!(table[entry] & PAGE_PRESENT) || (table[entry] & PAGE_HUGE))
+    return NULL;
+
+  return PAGING_VIRTUAL_OFFSET + (void *)(table[entry] & PAGE_ADDR_MASK);
+}
+
+/*
+ * Range walks go through a cursor. It keeps the pml3, pml2 and pml1 the
+ * last address was found in, a neighbouring address only descends from
+ * the deepest of them that still covers it instead of from the pml4.
+ * Level 0 is the pml4, an entry at `level` maps 1 << level_shift(level).
+ */
+static inline int level_shift(int level) { return 39 - 9 * level; }
+
+void vmm_cursor_init(struct vmm_cursor *cur, PageTable *pml4) {
+  uintptr_t root = (uintptr_t)pml4;
+
+  cur->pml4 = (uintptr_t *)root;
+  for (int i = 0; i < 3; i++)
+    cur->tables[i] = NULL;
+}
+
+/*
+ * Entry for `virt` at the level mapping `want` bytes, making tables and
+ * splitting huge pages on the way down. With `want` 0 nothing is changed,
+ * the walk stops at the first hole (NULL) or leaf. `size` is how much the
+ * entry maps, or would map for a hole.
+ */
+static uintptr_t *cursor_walk(struct vmm_cursor *cur, uintptr_t virt,
+                              size_t want, size_t *size) {
+  uintptr_t *table = cur->pml4;
+  int level = 0;
+
+  // a cached table is only a shortcut if its entries aren't too small
+  for (int i = 2; i >= 0; i--) {
+    if (cur->tables[i] && cur->tags[i] == virt >> level_shift(i) &&
+        (!want || (1ull << level_shift(i + 1)) >= want)) {
+      table = cur->tables[i];
+      level = i + 1;
+      break;
+    }
+  }
+
+  for (;; level++) {
+    int shift = level_shift(level);
+    uintptr_t *entry = &table[(virt >> shift) & 0x1ff];
+
+    *size = 1ull << shift;
+    if (level == 3 || *size == want)
+      return entry;
+
+    if ((*entry & PAGE_PRESENT) && (*entry & PAGE_HUGE)) {
+      if (!want)
+        return entry;
+      split_huge(entry, *size);
+    }
+
+    if (!(*entry & PAGE_PRESENT)) {
+      if (!want)
+        return NULL;
+
+      void *addr = alloc_table();
+      if (!addr)
+        panic("vmm: no memory for a page table");
+
+      *entry = (uintptr_t)addr | PAGE_USER | PAGE_WRITE | PAGE_PRESENT;
+    }
+
+    table = lookup_next_table(table, (virt >> shift) & 0x1ff);
+    cur->tables[level] = table;
+    cur->tags[level] = virt >> shift;
+  }
+}
+
+/* like vmm_get_entry */
+uintptr_t *vmm_cursor_entry(struct vmm_cursor *cur, uintptr_t virt,
+                            size_t *size) {
+  return cursor_walk(cur, virt, 0, size);
+}
+
+/* huge mappings count as a mapping of every frame in them */
+static void adjust_mapcount(uintptr_t phys, size_t size, int delta) {
+  for (uintptr_t addr = phys; addr < phys + size; addr += PAGE_SIZE) {
+    if (addr / PAGE_SIZE >= pmm_get_block_count())
+      break; // device memory past the end of ram
+
+    struct page *page = pmm_page(addr);
+    if (!page)
+      continue;
+
+    if (delta > 0)
+      page->mapcount++;
+    else if (page->mapcount)
+      page->mapcount--;
+  }
+}
+
+/*
+ * Map a 4K, 2M or 1G page, `flags` may carry a CACHE_* type. A huge page
+ * fails if smaller pages are already mapped there, their tables would be
+ * leaked.
+ */
+bool vmm_cursor_map(struct vmm_cursor *cur, uintptr_t virt, uintptr_t phys,
+                    int flags, size_t size) {
+  size_t got;
+  uintptr_t *entry = cursor_walk(cur, virt, size, &got);
+
+  if (*entry & PAGE_PRESENT) {
+    if (size > PAGE_SIZE && !(*entry & PAGE_HUGE))
+      return false;
+    adjust_mapcount(*entry & PAGE_ADDR_MASK & ~(size - 1), size, -1);
+  }
+
+  adjust_mapcount(phys, size, 1);
+
+  // the kernel half is the same in every address space
+  if (virt >= (uintptr_t)PAGING_VIRTUAL_OFFSET)
+    flags |= PAGE_GLOBAL;
+
+  *entry = phys | (flags & (0x7 | PAGE_CACHE_MASK | PAGE_GLOBAL | PAGE_COW));
+  if (size > PAGE_SIZE)
+    *entry |= PAGE_HUGE;
+
+  return true;
+}
+
+/*
+ * Clears whatever maps `virt` and returns the frame it pointed at, 0 if
+ * none. `size` is set to how much was unmapped. A huge page is unmapped
+ * whole when `virt` is its start, otherwise it is split first.
+ */
+uintptr_t vmm_cursor_unmap(struct vmm_cursor *cur, uintptr_t virt,
+                           size_t *size) {
+  uintptr_t *entry = cursor_walk(cur, virt, 0, size);
+
+  if (!entry || !(*entry & PAGE_PRESENT)) {
+    *size = PAGE_SIZE;
+    return 0;
+  }
+
+  if (*size > PAGE_SIZE && (virt & (*size - 1))) {
+    split_huge(entry, *size);
+    return vmm_cursor_unmap(cur, virt, size);
+  }
+
+  uintptr_t phys = *entry & PAGE_ADDR_MASK & ~(*size - 1);
+  *entry = 0;
+  vmm_invlpg(virt);
+
+  adjust_mapcount(phys, *size, -1);
+
+  return phys;
+}
+
+/* single address versions of the above */
+
+uintptr_t *vmm_get_entry(PageTable *pml4, uintptr_t virt, size_t *size) {
+  struct vmm_cursor cur;
+  vmm_cursor_init(&cur, pml4);
+  return vmm_cursor_entry(&cur, virt, size);
+}
 
-    if (addr == NULL) {
+/* the 4K pte for `virt`, NULL if there is none or a huge page maps it */
+uintptr_t *vmm_get_pte(PageTable *pml4, uintptr_t virt) {
+  size_t size;
+  uintptr_t *entry = vmm_get_entry(pml4, virt, &size);
 
-      kprintf("Found null addr\n");
-      for (;;)
-        ; // panic here
+  return entry && size == PAGE_SIZE ? entry : NULL;
+}
+
+uintptr_t vmm_virt_to_phys(PageTable *pml4, uintptr_t virt) {
+  size_t size;
+  uintptr_t *entry = vmm_get_entry(pml4, virt, &size);
+
+  if (!entry || !(*entry & PAGE_PRESENT))
+    return 0;
+
+  return (*entry & PAGE_ADDR_MASK & ~(size - 1)) | (virt & (size - 1));
+}
+
+void vmm_map_page(PageTable *pml4, uintptr_t virt, uintptr_t phys, int flags,
+                  int cache) {
+  struct vmm_cursor cur;
+  vmm_cursor_init(&cur, pml4);
+  vmm_cursor_map(&cur, virt, phys, flags | cache, PAGE_SIZE);
+}
+
+bool vmm_map_huge(PageTable *pml4, uintptr_t virt, uintptr_t phys, int flags,
+                  size_t size) {
+  struct vmm_cursor cur;
+  vmm_cursor_init(&cur, pml4);
+  return vmm_cursor_map(&cur, virt, phys, flags, size);
+}
+
+uintptr_t vmm_unmap(PageTable *pml4, uintptr_t virt, size_t *size) {
+  struct vmm_cursor cur;
+  vmm_cursor_init(&cur, pml4);
+  return vmm_cursor_unmap(&cur, virt, size);
+}
+
+/* a huge page that doesn't fit inside [virt, end) has to be split */
+static bool straddles(uintptr_t virt, uintptr_t end, size_t size) {
+  return size > PAGE_SIZE && ((virt & (size - 1)) || end - virt < size);
+}
+
+/*
+ * Unmap [virt, virt + size), huge pages only partly inside are split.
+ * With `release` the references to the frames are dropped as well.
+ */
+void vmm_unmap_range(PageTable *pml4, uintptr_t virt, size_t size,
+                     bool release) {
+  struct vmm_cursor cur;
+  uintptr_t end = virt + size;
+  size_t step;
+
+  vmm_cursor_init(&cur, pml4);
+
+  while (virt < end) {
+    uintptr_t *entry = vmm_cursor_entry(&cur, virt, &step);
+
+    if (!entry) {
+      virt = (virt & ~(step - 1)) + step;
+      continue;
+    }
+
+    if (zswap_swapped(*entry)) {
+      if (release)
+        zswap_drop(*entry);
+      *entry = 0;
+      virt += step;
+      continue;
+    }
+
+    if ((*entry & PAGE_PRESENT) && straddles(virt, end, step)) {
+      split_huge(entry, step);
+      continue;
+    }
+
+    uintptr_t phys = vmm_cursor_unmap(&cur, virt, &step);
+    if (phys && release)
+      for (uintptr_t addr = phys; addr < phys + step; addr += PAGE_SIZE)
+        pmm_page_put(addr);
+
+    virt += step;
+  }
+}
+
+/*
+ * Give everything mapped in [virt, virt + size) the permissions in
+ * `flags`. Private frames still shared with another process only become
+ * writable through copy-on-write, `shared` ranges are written in place.
+ */
+void vmm_protect_range(PageTable *pml4, uintptr_t virt, size_t size,
+                       int flags, bool shared) {
+  struct vmm_cursor cur;
+  uintptr_t end = virt + size;
+  size_t step;
+
+  vmm_cursor_init(&cur, pml4);
+
+  while (virt < end) {
+    uintptr_t *entry = vmm_cursor_entry(&cur, virt, &step);
+
+    if (!entry) {
+      virt = (virt & ~(step - 1)) + step;
+      continue;
+    }
+
+    if (!(*entry & PAGE_PRESENT)) {
+      virt += step;
+      continue;
     }
 
-    table[entry] = (uintptr_t)addr | PAGE_USER | PAGE_WRITE | PAGE_PRESENT;
+    uintptr_t phys = *entry & PAGE_ADDR_MASK & ~(step - 1);
+    struct page *page = pmm_page(phys);
+    uintptr_t perms = flags & 0x7;
+
+    if (!shared && (perms & PAGE_WRITE) && page &&
+        __atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE) > 1) {
+      // copy-on-write works on 4K frames
+      if (step > PAGE_SIZE) {
+        split_huge(entry, step);
+        continue;
+      }
+
+      perms = (perms & ~PAGE_WRITE) | PAGE_COW;
+    }
+
+    if (straddles(virt, end, step)) {
+      split_huge(entry, step);
+      continue;
+    }
+
+    *entry = (*entry & ~(uintptr_t)(0x7 | PAGE_COW)) | perms;
+    virt += step;
+  }
+}
+
+/*
+ * Give kernel memory that is already mapped another memory type, e.g. the
+ * framebuffer the bootloader put in the hhdm as write-back.
+ */
+void vmm_set_cache(void *virt, size_t size, int cache) {
+  struct vmm_cursor cur;
+  uintptr_t start = (uintptr_t)virt & ~(uintptr_t)(PAGE_SIZE - 1);
+  uintptr_t end = ALIGN_UP((uintptr_t)virt + size, PAGE_SIZE);
+  size_t step;
+
+  vmm_cursor_init(&cur, PAGING_VIRTUAL_OFFSET + (void *)kernel_cr3);
+
+  for (uintptr_t addr = start; addr < end;) {
+    uintptr_t *entry = vmm_cursor_entry(&cur, addr, &step);
+
+    if (!entry) {
+      addr = (addr & ~(step - 1)) + step;
+      continue;
+    }
+
+    if ((*entry & PAGE_PRESENT) && straddles(addr, end, step)) {
+      split_huge(entry, step);
+      continue;
+    }
+
+    if (*entry & PAGE_PRESENT)
+      *entry = (*entry & ~(uintptr_t)PAGE_CACHE_MASK) | cache;
+
+    addr += step;
   }
 
-  return PAGING_VIRTUAL_OFFSET + addr;
+  // lines cached under the old type mustn't be written back later, and
+  // invlpg is the only flush that drops global entries
+  asm volatile("wbinvd" ::: "memory");
+  for (uintptr_t addr = start; addr < end; addr += PAGE_SIZE)
+    vmm_invlpg(addr);
 }
 
-void vmm_map_page(PageTable *pml4, uintptr_t virt, uintptr_t phys, int flags) {
+/*
+ * Replace the 512 pages under the 2M aligned `virt` by one 2M page with
+ * the same contents. Only done when every page is present, private to
+ * this process and mapped with the same permissions, anything else could
+ * see the copy go stale. The old frames and their table are freed.
+ */
+bool vmm_collapse_huge(PageTable *pml4, uintptr_t virt) {
   PageIndex indices = vmm_get_page_index(virt);
+  uintptr_t root = (uintptr_t)pml4;
 
-  uintptr_t *pml3 = get_next_table((uintptr_t *)pml4, indices.pml4i);
-  uintptr_t *pml2 = get_next_table(pml3, indices.pml3i);
-  uintptr_t *pml1 = get_next_table(pml2, indices.pml2i);
-  uintptr_t *p_pte = &pml1[indices.pml1i];
+  uintptr_t *pml3 = lookup_next_table((uintptr_t *)root, indices.pml4i);
+  uintptr_t *pml2 = pml3 ? lookup_next_table(pml3, indices.pml3i) : NULL;
+  uintptr_t *pml1 = pml2 ? lookup_next_table(pml2, indices.pml2i) : NULL;
 
-  *p_pte = phys | (flags & 0x7);
+  if (!pml1)
+    return false;
 
-  return;
+  uintptr_t perms = pml1[0] & 0x7;
+  for (int i = 0; i < 512; i++) {
+    struct page *page = pmm_page(pml1[i] & PAGE_ADDR_MASK);
+
+    if (!(pml1[i] & PAGE_PRESENT) || (pml1[i] & PAGE_COW) ||
+        (pml1[i] & 0x7) != perms || !page || page->refcount != 1 ||
+        page->mapcount != 1)
+      return false;
+  }
+
+  // compaction may move the small pages around to make room, the ptes
+  // are read again below
+  void *huge = pmm_alloc_huge(PMM_ORDER_2M);
+  if (!huge)
+    return false;
+
+  for (int i = 0; i < 512; i++)
+    memcpy(PAGING_VIRTUAL_OFFSET + huge + i * PAGE_SIZE,
+           PAGING_VIRTUAL_OFFSET + (void *)(pml1[i] & PAGE_ADDR_MASK),
+           PAGE_SIZE);
+
+  uintptr_t table = pml2[indices.pml2i] & PAGE_ADDR_MASK;
+  pml2[indices.pml2i] = (uintptr_t)huge | perms | PAGE_HUGE;
+  adjust_mapcount((uintptr_t)huge, PAGE_SIZE_2M, 1);
+
+  for (int i = 0; i < 512; i++) {
+    uintptr_t phys = pml1[i] & PAGE_ADDR_MASK;
+    pmm_page(phys)->mapcount--;
+    pmm_page_put(phys);
+  }
+
+  pmm_free_block(table);
+
+  return true;
+}
+
+/* largest page that fits at virt/phys with `left` bytes to go */
+static size_t map_step(uintptr_t virt, uintptr_t phys, size_t left) {
+  if (gb_pages && !((virt | phys) & (PAGE_SIZE_1G - 1)) && left >= PAGE_SIZE_1G)
+    return PAGE_SIZE_1G;
+
+  if (!((virt | phys) & (PAGE_SIZE_2M - 1)) && left >= PAGE_SIZE_2M)
+    return PAGE_SIZE_2M;
+
+  return PAGE_SIZE;
 }
 
 void vmm_map_range(PageTable *cr3, void *virt_start, void *phys_start,
-                   size_t size, int flags) {
+                   size_t size, int flags, int cache) {
 
   if (size % PAGE_SIZE != 0 || (u64)virt_start % PAGE_SIZE != 0 ||
       (u64)phys_start % PAGE_SIZE != 0) {
@@ -90,8 +526,24 @@ void vmm_map_range(PageTable *cr3, void *virt_start, void *phys_start,
   kprintf("[VMM] virt_end is 0x%x\n", virt_end);
 #endif
 
-  for (; vaddr <= (virt_start + size); vaddr += PAGE_SIZE, paddr += PAGE_SIZE)
-    vmm_map_page(cr3, (uintptr_t)vaddr, (uintptr_t)paddr, flags);
+  struct vmm_cursor cur;
+  vmm_cursor_init(&cur, cr3);
+  flags |= cache;
+
+  // aligned stretches get 2M or 1G pages
+  while (vaddr < virt_end) {
+    size_t step =
+        map_step((uintptr_t)vaddr, (uintptr_t)paddr, virt_end - vaddr);
+
+    if (!vmm_cursor_map(&cur, (uintptr_t)vaddr, (uintptr_t)paddr, flags,
+                        step)) {
+      step = PAGE_SIZE;
+      vmm_cursor_map(&cur, (uintptr_t)vaddr, (uintptr_t)paddr, flags, step);
+    }
+
+    vaddr += step;
+    paddr += step;
+  }
 
   return;
 }
@@ -106,41 +558,95 @@ void vmm_map_kernel(PageTable *cr3) {
 
 void vmm_copy_vas(ProcessControlBlock *new, ProcessControlBlock *orig) {
 
-  PageTable *new_vas = (void *)(pmm_alloc_block() + PAGING_VIRTUAL_OFFSET);
-  memset(new_vas, 0, sizeof(PageTable));
+  PageTable *new_vas = (void *)(alloc_table() + PAGING_VIRTUAL_OFFSET);
 
   vmm_map_kernel(new_vas);
 
+  PageTable *orig_vas = (void *)orig->cr3 + PAGING_VIRTUAL_OFFSET;
+
+  struct vmm_cursor from, to;
+  vmm_cursor_init(&from, orig_vas);
+  vmm_cursor_init(&to, new_vas);
+
   // kprintf("[VMM]    Cloning page map\n");
 
-  for (VASRangeNode *cnode = orig->vas; cnode; cnode = cnode->next) {
+  for (VASRangeNode *cnode = proc_first_vas_range(orig); cnode;
+       cnode = proc_next_vas_range(cnode)) {
 #ifdef VMM_DEBUG
     kprintf("Mapping virtual 0x%x with size %d bytes\n", cnode->virt_start,
             cnode->size);
 #endif
 
-    void *clone_phys_addr = pmm_alloc_blocks(cnode->size / PAGE_SIZE);
+    /*
+     * frames of a range are not necessarily contiguous (compaction can
+     * move them), so share page by page through the parent's page tables.
+     * Private pages are mapped read-only in both processes, the first
+     * write from either side copies the frame in vmm_handle_cow. Frames
+     * of shared ranges belong to whoever set them up and unmapping never
+     * drops them, so the child takes no references to those.
+     */
+    bool shared = cnode->vm_flags & VM_SHARED;
 
-#ifdef VMM_DEBUG
-    kprintf("Copying from physical %x to %x. Virt: %x\n",
-            PAGING_VIRTUAL_OFFSET + cnode->phys_start,
-            PAGING_VIRTUAL_OFFSET + clone_phys_addr, cnode->virt_start);
-#endif
+    size_t step;
+    for (size_t off = 0; off < cnode->size; off += step) {
+      uintptr_t virt = (uintptr_t)cnode->virt_start + off;
+      uintptr_t *pte = vmm_cursor_entry(&from, virt, &step);
 
-    // copy memory before mapping range
-    memcpy(PAGING_VIRTUAL_OFFSET + clone_phys_addr,
-           PAGING_VIRTUAL_OFFSET + cnode->phys_start, cnode->size);
+      // skip missing tables whole
+      if (!pte) {
+        step = (virt & ~(step - 1)) + step - virt;
+        continue;
+      }
 
-    vmm_map_range(new_vas, cnode->virt_start, clone_phys_addr, cnode->size,
-                  cnode->page_flags);
+      if (!(*pte & PAGE_PRESENT)) {
+        // compressed pages are shared until either side faults them in
+        if (zswap_swapped(*pte)) {
+          zswap_dup(*pte);
+          *cursor_walk(&to, virt, PAGE_SIZE, &step) = *pte;
+        }
+
+        step = PAGE_SIZE;
+        continue;
+      }
+
+      // copy-on-write works on 4K frames, private huge pages get split
+      while (step > PAGE_SIZE &&
+             ((!shared && (*pte & PAGE_WRITE)) || (virt & (step - 1)))) {
+        split_huge(pte, step);
+        pte = vmm_cursor_entry(&from, virt, &step);
+      }
+
+      if (step > PAGE_SIZE) {
+        uintptr_t phys = *pte & PAGE_ADDR_MASK & ~(step - 1);
+        for (uintptr_t addr = phys; !shared && addr < phys + step;
+             addr += PAGE_SIZE)
+          pmm_page_get(addr);
+
+        int flags = *pte & (0x7 | PAGE_CACHE_MASK | PAGE_COW);
+        vmm_cursor_map(&to, virt, phys, flags, step);
+        continue;
+      }
+
+      uintptr_t phys = *pte & PAGE_ADDR_MASK;
+      int flags = *pte & (0x7 | PAGE_CACHE_MASK | PAGE_COW);
+
+      // shared ranges keep pointing at the same frames, writable
+      if (!shared && (flags & PAGE_WRITE)) {
+        flags = (flags & ~PAGE_WRITE) | PAGE_COW;
+        *pte = phys | flags;
+      }
+
+      if (!shared)
+        pmm_page_get(phys);
+      vmm_cursor_map(&to, virt, phys, flags, PAGE_SIZE);
+    }
 
     // update cloned procs VAS
-    VASRangeNode *node = kmem_alloc(sizeof(VASRangeNode));
+    VASRangeNode *node = kmem_cache_alloc(vas_range_cache);
     node->virt_start = cnode->virt_start;
-    node->phys_start = cnode->phys_start;
     node->page_flags = cnode->page_flags;
+    node->vm_flags = cnode->vm_flags;
     node->size = cnode->size;
-    node->next = NULL;
 
     proc_add_vas_range(new, node);
   }
@@ -151,13 +657,72 @@ void vmm_copy_vas(ProcessControlBlock *new, ProcessControlBlock *orig) {
 
   new->cr3 = (void *)new_vas - PAGING_VIRTUAL_OFFSET;
 
+  new->pcid = vmm_alloc_pcid();
+  new->tlb_stale = true;
+
+  // the parent may still have writable translations cached
+  vmm_flush_tlb(orig);
+
   return;
 }
 
+/*
+ * Resolve a write fault on a copy-on-write page. Returns false if the
+ * fault wasn't caused by copy-on-write.
+ */
+static bool vmm_handle_cow(PageTable *pml4, uintptr_t virt) {
+  size_t size;
+  uintptr_t *pte = vmm_get_entry(pml4, virt, &size);
+
+  // copies are made a 4K frame at a time
+  while (pte && size > PAGE_SIZE && (*pte & PAGE_PRESENT) &&
+         (*pte & PAGE_COW)) {
+    split_huge(pte, size);
+    pte = vmm_get_entry(pml4, virt, &size);
+  }
+
+  if (size > PAGE_SIZE)
+    return false;
+
+  if (!pte || !(*pte & PAGE_PRESENT) || !(*pte & PAGE_COW))
+    return false;
+
+  uintptr_t phys = *pte & PAGE_ADDR_MASK;
+  int flags = (*pte & 0x7) | PAGE_WRITE;
+  struct page *page = pmm_page(phys);
+
+  // every other sharer already took its copy, the frame is ours
+  if (page && __atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE) == 1) {
+    *pte = phys | flags;
+    vmm_invlpg(virt & ~(uintptr_t)(PAGE_SIZE - 1));
+    return true;
+  }
+
+  void *copy = pmm_alloc_block();
+  if (!copy)
+    return false;
+
+  memcpy(PAGING_VIRTUAL_OFFSET + copy, PAGING_VIRTUAL_OFFSET + (void *)phys,
+         PAGE_SIZE);
+
+  vmm_map_page(pml4, virt & ~(uintptr_t)(PAGE_SIZE - 1), (uintptr_t)copy,
+               flags, CACHE_WB);
+  vmm_invlpg(virt & ~(uintptr_t)(PAGE_SIZE - 1));
+
+  if (page && (page->flags & PG_KSM))
+    ksm_count_unmerge();
+
+  pmm_page_put(phys);
+
+  return true;
+}
+
 PageTable *vmm_create_user_proc_pml4(ProcessControlBlock *proc) {
 
-  PageTable *pml4 = (PageTable *)(pmm_alloc_block() + PAGING_VIRTUAL_OFFSET);
-  memset(pml4, 0x0, PAGE_SIZE);
+  PageTable *pml4 = (PageTable *)(alloc_table() + PAGING_VIRTUAL_OFFSET);
+
+  proc->pcid = vmm_alloc_pcid();
+  proc->tlb_stale = true;
 
   extern PageTable *kernel_cr3;
 
@@ -176,9 +741,342 @@ void vmm_switch_page_directory(PageTable *cr3) {
 }
 
 PageTable *vmm_get_current_cr3() {
-  PageTable *current_cr3;
+  u64 current_cr3;
   asm volatile(" mov %%cr3, %0" : "=r"(current_cr3));
-  return current_cr3;
+
+  // low bits hold the pcid
+  return (PageTable *)(current_cr3 & PAGE_ADDR_MASK);
+}
+
+u16 vmm_alloc_pcid() {
+  if (!pcid_enabled)
+    return 0;
+
+  u16 pcid = next_pcid++;
+  if (next_pcid == MAX_PCID)
+    next_pcid = 1;
+
+  return pcid;
+}
+
+/* value to load into cr3 to run `proc`, only flushing when we have to */
+u64 vmm_proc_cr3(ProcessControlBlock *proc) {
+  u64 cr3 = (u64)proc->cr3;
+
+  if (!pcid_enabled)
+    return cr3;
+
+  cr3 |= proc->pcid;
+
+  if (!proc->pcid ||
+      (pcid_owner[proc->pcid] == proc && !proc->tlb_stale))
+    return cr3 | CR3_NOFLUSH;
+
+  pcid_owner[proc->pcid] = proc;
+  proc->tlb_stale = false;
+  return cr3;
+}
+
+/* visit the pages of `proc` from `*from` on, see vmm_walk_anon */
+static int walk_anon_proc(ProcessControlBlock *proc, uintptr_t *from,
+                          vmm_anon_visitor visit, void *ctx) {
+  PageTable *pml4 = (void *)proc->cr3 + PAGING_VIRTUAL_OFFSET;
+  struct vmm_cursor cur;
+  int did = 0;
+
+  vmm_cursor_init(&cur, pml4);
+
+  for (VASRangeNode *range = proc_vas_lower_bound(proc, *from); range;
+       range = proc_next_vas_range(range)) {
+    // PROT_NONE pages are left alone, they couldn't be faulted back in
+    if (!(range->vm_flags & VM_ANON) || !(range->page_flags & PAGE_USER))
+      continue;
+
+    uintptr_t end = (uintptr_t)range->virt_start + range->size;
+    size_t step;
+
+    for (uintptr_t virt = MAX(*from, (uintptr_t)range->virt_start);
+         virt < end; virt += step) {
+      uintptr_t *pte = vmm_cursor_entry(&cur, virt, &step);
+
+      // holes and huge pages are skipped whole
+      bool small = pte && step == PAGE_SIZE && (*pte & PAGE_PRESENT);
+      step = (virt & ~(step - 1)) + step - virt;
+      if (!small)
+        continue;
+
+      did |= visit(proc, range, &cur, virt, pte, ctx);
+      if (did & VMM_WALK_STOP) {
+        *from = virt + step;
+        goto out;
+      }
+    }
+  }
+
+out:
+  if (did & VMM_WALK_CHANGED)
+    vmm_flush_tlb(proc);
+
+  return did;
+}
+
+/*
+ * Visit every small, present page of the anonymous user ranges of the
+ * processes on the ready queue, from `hand` to the end of the queue.
+ * Interrupts are off while a process is walked, the scheduler only runs
+ * on this cpu so its tables can't change under the visitor, and are
+ * restored between processes. The tlb of a process is flushed after its
+ * walk if a visitor changed anything.
+ *
+ * A visitor stopping the walk leaves `hand` at the page after it, the
+ * next walk goes on from there. Returns true, with `hand` back at the
+ * head of the queue, if the end of the queue was reached.
+ */
+bool vmm_walk_anon(struct vmm_anon_hand *hand, vmm_anon_visitor visit,
+                   void *ctx) {
+  u64 flags = irq_save();
+
+  // the process the hand was in may have exited since
+  ProcessControlBlock *proc = TAILQ_FIRST(&readyq);
+  uintptr_t from = 0;
+
+  for (ProcessControlBlock *p = proc; hand->proc && p;
+       p = TAILQ_NEXT(p, entries)) {
+    if (p == hand->proc) {
+      proc = p;
+      from = hand->virt;
+      break;
+    }
+  }
+
+  while (proc) {
+    int did = walk_anon_proc(proc, &from, visit, ctx);
+
+    if (did & VMM_WALK_STOP) {
+      hand->proc = proc;
+      hand->virt = from;
+      irq_restore(flags);
+      return false;
+    }
+
+    proc = TAILQ_NEXT(proc, entries);
+    from = 0;
+
+    // let everybody else run between processes
+    irq_restore(flags);
+    flags = irq_save();
+  }
+
+  irq_restore(flags);
+
+  hand->proc = NULL;
+  hand->virt = 0;
+
+  return true;
+}
+
+/* forget cached translations of `proc`, now or when it next runs */
+void vmm_flush_tlb(ProcessControlBlock *proc) {
+  if (proc->cr3 == vmm_get_current_cr3())
+    invalidate_tlb();
+  else
+    proc->tlb_stale = true;
+}
+
+/* set G on every leaf the bootloader mapped below `table` */
+static void mark_global(uintptr_t *table, int level) {
+  for (int i = 0; i < 512; i++) {
+    if (!(table[i] & PAGE_PRESENT))
+      continue;
+
+    if (level == 1 || (table[i] & PAGE_HUGE))
+      table[i] |= PAGE_GLOBAL;
+    else
+      mark_global(lookup_next_table(table, i), level - 1);
+  }
+}
+
+/*
+ * The power-on PAT repeats WB, WT, UC-, UC. Entry 1 becomes write-combining
+ * so CACHE_WC only needs PWT, the PAT bit itself is never set. Every cpu
+ * has to use the same table.
+ */
+void vmm_init_pat() {
+  static const u8 types[8] = {PAT_WB, PAT_WC, PAT_UC_MINUS, PAT_UC,
+                              PAT_WB, PAT_WP, PAT_UC_MINUS, PAT_WT};
+  u32 eax, ebx, ecx, edx;
+
+  asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+  if (!(edx & CPUID_PAT)) {
+    kprintf("[VMM] No PAT, write-combining falls back to write-through\n");
+    return;
+  }
+
+  u64 pat = 0;
+  for (int i = 0; i < 8; i++)
+    pat |= (u64)types[i] << (i * 8);
+
+  asm volatile("wbinvd" ::: "memory");
+  wrmsr(MSR_PAT, pat);
+  asm volatile("wbinvd" ::: "memory");
+}
+
+static void vmm_init_tlb() {
+  u32 eax, ebx, ecx, edx;
+
+  u32 ext_edx;
+  asm volatile("cpuid"
+               : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(ext_edx)
+               : "a"(0x80000001));
+  gb_pages = ext_edx & CPUID_1GB_PAGES;
+
+  asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1));
+
+  u64 cr3, cr4;
+  asm volatile("mov %%cr3, %0" : "=r"(cr3));
+  asm volatile("mov %%cr4, %0" : "=r"(cr4));
+
+  if (edx & CPUID_PGE) {
+    uintptr_t *pml4 = PAGING_VIRTUAL_OFFSET + (void *)kernel_cr3;
+    for (int i = 256; i < 512; i++)
+      if (pml4[i] & PAGE_PRESENT)
+        mark_global(lookup_next_table(pml4, i), 3);
+
+    cr4 |= CR4_PGE;
+  }
+
+  // PCIDE can only be turned on while running with pcid 0
+  if ((ecx & CPUID_PCID) && !(cr3 & 0xfff)) {
+    cr4 |= CR4_PCIDE;
+    pcid_enabled = true;
+  }
+
+  asm volatile("mov %0, %%cr4" ::"r"(cr4) : "memory");
+
+  // drops the non-global entries cached before PGE was on
+  invalidate_tlb();
+
+  kprintf("[VMM] Global pages %s, PCID %s, 1G pages %s\n",
+          cr4 & CR4_PGE ? "on" : "off", pcid_enabled ? "on" : "off",
+          gb_pages ? "on" : "off");
+}
+
+/*
+ * Anonymous pages are only backed once they are first touched. A fault
+ * maps a window of untouched neighbours with it, so walking a fresh
+ * region doesn't trap once per page. Normally that is the
+ * FAULT_AROUND_MIN aligned pages around the fault. A fault right where
+ * the last window ended looks like a sequential scan, so the window
+ * doubles and runs ahead of it, up to FAULT_AROUND_MAX.
+ */
+static bool vmm_handle_anon(ProcessControlBlock *proc, PageTable *pml4,
+                            uintptr_t virt) {
+  VASRangeNode *range = proc_find_vas_range(proc, virt);
+
+  // PROT_NONE ranges are kernel only
+  if (!range || !(range->vm_flags & VM_ANON) ||
+      !(range->page_flags & PAGE_USER))
+    return false;
+
+  uintptr_t page = virt & ~(uintptr_t)(PAGE_SIZE - 1);
+  struct vmm_cursor cur;
+  size_t size;
+
+  vmm_cursor_init(&cur, pml4);
+
+  // compressed by zswap, only this page comes back
+  uintptr_t *entry = vmm_cursor_entry(&cur, page, &size);
+  if (entry && zswap_swapped(*entry)) {
+    void *frame = pmm_alloc_block();
+    if (!frame && zswap_reclaim(ZSWAP_SCAN_BATCH))
+      frame = pmm_alloc_block();
+    if (!frame)
+      return false;
+
+    zswap_load(*entry, (uintptr_t)frame);
+    *entry = 0;
+    vmm_cursor_map(&cur, page, (uintptr_t)frame, range->page_flags,
+                   PAGE_SIZE);
+    return true;
+  }
+
+  uintptr_t start;
+
+  if (page == range->fault_next) {
+    range->fault_window = MIN(range->fault_window * 2, FAULT_AROUND_MAX);
+    start = page;
+  } else {
+    range->fault_window = FAULT_AROUND_MIN;
+    start = page & ~(uintptr_t)(FAULT_AROUND_MIN * PAGE_SIZE - 1);
+  }
+
+  uintptr_t range_end = (uintptr_t)range->virt_start + range->size;
+  uintptr_t end = MIN(start + range->fault_window * PAGE_SIZE, range_end);
+  start = MAX(start, (uintptr_t)range->virt_start);
+  range->fault_next = end;
+
+  // out of memory, make some by compressing cold pages
+  void *frame = zero_alloc_block();
+  if (!frame && zswap_reclaim(ZSWAP_SCAN_BATCH))
+    frame = zero_alloc_block();
+  if (!frame)
+    return false;
+
+  vmm_cursor_map(&cur, page, (uintptr_t)frame, range->page_flags, PAGE_SIZE);
+
+  // the neighbours are a guess, leave the last pages to real faults
+  for (uintptr_t addr = start; addr < end; addr += PAGE_SIZE) {
+    entry = vmm_cursor_entry(&cur, addr, &size);
+
+    // present, or compressed and left for its own fault
+    if (entry && *entry)
+      continue;
+
+    if (pmm_get_free_block_count() < ZERO_POOL_PAGES * 4)
+      break;
+
+    frame = zero_alloc_block();
+    if (!frame)
+      break;
+
+    vmm_cursor_map(&cur, addr, (uintptr_t)frame, range->page_flags,
+                   PAGE_SIZE);
+  }
+
+  return true;
+}
+
+/*
+ * Called from the page fault handler, returns true if the fault was
+ * expected and the access can be retried.
+ */
+bool vmm_handle_fault(ProcessControlBlock *proc, uintptr_t virt,
+                      int error_code) {
+  PageTable *pml4 = (void *)vmm_get_current_cr3() + PAGING_VIRTUAL_OFFSET;
+
+  // only the lower half belongs to processes
+  if (!proc || virt >= 0x800000000000)
+    return false;
+
+  if (!(error_code & PAGE_PRESENT))
+    return vmm_handle_anon(proc, pml4, virt);
+
+  if (error_code & PAGE_WRITE)
+    return vmm_handle_cow(pml4, virt);
+
+  return false;
 }
 
-void vmm_init() { kernel_cr3 = vmm_get_current_cr3(); }
+void vmm_init() {
+  kernel_cr3 = vmm_get_current_cr3();
+
+  // make read-only pages read-only for the kernel too, or its writes to
+  // user memory would go straight into frames shared copy-on-write
+  u64 cr0;
+  asm volatile("mov %%cr0, %0" : "=r"(cr0));
+  asm volatile("mov %0, %%cr0" ::"r"(cr0 | CR0_WP) : "memory");
+
+  // before vmm_init_tlb, its cr4 write flushes what the old PAT cached
+  vmm_init_pat();
+  vmm_init_tlb();
+}
@@ -0,0 +1,137 @@
+#include <config.h>
+#include <cpu/cpu.h>
+#include <libk/kprintf.h>
+#include <libk/spinlock.h>
+#include <memory/pmm.h>
+#include <memory/vmm.h>
+#include <memory/zero.h>
+#include <proc/proc.h>
+
+/*
+ * Pool of already cleared pages.
+ *
+ * Page tables, anonymous mappings and the like want zeroed memory. Rather
+ * than clearing it on the allocation path, the "Zero" kernel process keeps
+ * a small stack of pages cleared ahead of time. It clears a batch, then
+ * halts until the next interrupt. Once the pool is full, or memory is too
+ * short to fill it, it waits and the scheduler passes over it until
+ * allocations take the pool below ZERO_POOL_LOW. Pages are cleared with
+ * non-temporal stores so the pool doesn't evict everybody else's cache
+ * lines.
+ */
+
+static struct {
+  uintptr_t pages[ZERO_POOL_PAGES]; /* physical addresses */
+  u64 count;
+} pool;
+
+static Spinlock zero_lock = SPINLOCK_INIT;
+static ProcessControlBlock *zero_thread;
+
+extern ProcessControlBlock *running;
+
+void zero_pages(void *virt, u64 pages) {
+  u64 *ptr = virt;
+  u64 *end = ptr + pages * PAGE_SIZE / sizeof(u64);
+
+  for (; ptr < end; ptr += 8)
+    asm volatile("movnti %1, 0(%0)\n"
+                 "movnti %1, 8(%0)\n"
+                 "movnti %1, 16(%0)\n"
+                 "movnti %1, 24(%0)\n"
+                 "movnti %1, 32(%0)\n"
+                 "movnti %1, 40(%0)\n"
+                 "movnti %1, 48(%0)\n"
+                 "movnti %1, 56(%0)\n" ::"r"(ptr),
+                 "r"(0ull)
+                 : "memory");
+
+  // non-temporal stores are weakly ordered
+  asm volatile("sfence" ::: "memory");
+}
+
+static uintptr_t zero_pool_pop() {
+  uintptr_t page = 0;
+
+  u64 flags = irq_save();
+  spin_lock(&zero_lock);
+  if (pool.count)
+    page = pool.pages[--pool.count];
+  if (pool.count < ZERO_POOL_LOW && zero_thread)
+    zero_thread->state = READY;
+  spin_unlock(&zero_lock);
+  irq_restore(flags);
+
+  return page;
+}
+
+static bool zero_pool_push(uintptr_t page) {
+  bool pushed = false;
+
+  u64 flags = irq_save();
+  spin_lock(&zero_lock);
+  if (pool.count < ZERO_POOL_PAGES) {
+    pool.pages[pool.count++] = page;
+    pushed = true;
+  }
+  spin_unlock(&zero_lock);
+  irq_restore(flags);
+
+  return pushed;
+}
+
+/* returns the physical address of a cleared page */
+void *zero_alloc_block() {
+  uintptr_t page = zero_pool_pop();
+  if (page)
+    return (void *)page;
+
+  // pool ran dry, clear one inline
+  void *addr = pmm_alloc_block();
+  if (addr)
+    zero_pages(PAGING_VIRTUAL_OFFSET + addr, 1);
+
+  return addr;
+}
+
+u64 zero_pool_count() { return pool.count; }
+
+void zero_proc() {
+  zero_thread = running;
+
+  for (;;) {
+    bool stuck = false;
+
+    for (int i = 0; i < ZERO_POOL_BATCH && pool.count < ZERO_POOL_PAGES; i++) {
+      // leave the last pages to whoever actually needs them
+      if (pmm_get_free_block_count() < ZERO_POOL_PAGES * 4) {
+        stuck = true;
+        break;
+      }
+
+      uintptr_t page = (uintptr_t)pmm_alloc_block();
+      if (!page) {
+        stuck = true;
+        break;
+      }
+
+      zero_pages(PAGING_VIRTUAL_OFFSET + (void *)page, 1);
+
+      if (!zero_pool_push(page)) {
+        pmm_free_block(page);
+        break;
+      }
+    }
+
+    // zero_pool_pop wakes us up again, the lock keeps it from doing so
+    // before we go to sleep
+    u64 flags = irq_save();
+    spin_lock(&zero_lock);
+    if (stuck || pool.count == ZERO_POOL_PAGES)
+      zero_thread->state = WAITING;
+    spin_unlock(&zero_lock);
+    irq_restore(flags);
+
+    asm volatile("hlt");
+  }
+}
@@ -0,0 +1,273 @@
+#include <libk/kprintf.h>
+#include <libk/lz4.h>
+#include <libk/util.h>
+#include <memory/pmm.h>
+#include <memory/slab.h>
+#include <memory/vmm.h>
+#include <memory/zswap.h>
+#include <proc/proc.h>
+#include <string/string.h>
+
+/*
+ * Compressed swap in ram.
+ *
+ * There is no swap device, so when free memory runs low cold anonymous
+ * pages are lz4 compressed into slab memory instead and their frames
+ * freed. The pte is left non-present with PAGE_SWAPPED set and the rest
+ * of it pointing at the zswap entry, the next touch faults the page back
+ * in through vmm_handle_anon. A fork shares the entry until either side
+ * touches it.
+ *
+ * Cold pages are found LRU style with the accessed bit. The "Zswap"
+ * kernel process turns a clock over the VM_ANON ranges of every process:
+ * a page used since the hand last passed has its bit cleared and is left
+ * alone, one that wasn't is compressed while memory is short. The hand
+ * stays where a turn stopped, so every process gets its share. A page
+ * fault that finds no free memory moves the hand on itself, at most once
+ * round, but only takes pages whose bit was already clear.
+ *
+ * Only private 4K pages are taken, copy-on-write, shared and huge pages
+ * stay where they are. Pages that are one word repeated, mostly pages
+ * faulted around but never written, only keep the word. Pages that don't
+ * compress under ZSWAP_MAX_LEN aren't worth it and stay as well.
+ */
+
+struct zswap_entry {
+  u32 refs; // ptes pointing at it
+  u32 len;  // compressed size, 0 if the page is `fill` repeated
+  union {
+    u8 *data;
+    u64 fill;
+  };
+};
+
+static struct kmem_cache *entry_cache;
+
+// only touched with interrupts off on the scheduler's cpu
+static u8 scratch[ZSWAP_MAX_LEN];
+static u8 lz4_work[LZ4_WORKMEM_SIZE];
+
+static struct {
+  u64 stored;      // entries alive
+  u64 same_filled; // of those, without data
+  u64 pool_bytes;  // compressed data kept
+  u64 rejected;    // pages that didn't compress well enough
+  u64 loads;       // pages faulted back in
+} stats;
+
+/* the entry is kept as an offset into the hhdm above the flag bits */
+static inline uintptr_t entry_pte(struct zswap_entry *entry) {
+  return ((uintptr_t)entry - (uintptr_t)PAGING_VIRTUAL_OFFSET) << 12 |
+         PAGE_SWAPPED;
+}
+
+static inline struct zswap_entry *pte_entry(uintptr_t pte) {
+  return (void *)((pte >> 12) + (uintptr_t)PAGING_VIRTUAL_OFFSET);
+}
+
+static u64 pool_limit() {
+  return pmm_get_block_count() * PAGE_SIZE / 100 * ZSWAP_MAX_POOL_PERCENT;
+}
+
+/* a copy of the page at `phys`, NULL if it isn't worth keeping */
+static struct zswap_entry *compress(uintptr_t phys) {
+  u64 *words = PAGING_VIRTUAL_OFFSET + (void *)phys;
+  size_t i;
+
+  for (i = 1; i < PAGE_SIZE / sizeof(u64); i++)
+    if (words[i] != words[0])
+      break;
+
+  struct zswap_entry *entry = kmem_cache_alloc(entry_cache);
+  if (!entry)
+    return NULL;
+
+  entry->refs = 1;
+
+  if (i == PAGE_SIZE / sizeof(u64)) {
+    entry->len = 0;
+    entry->fill = words[0];
+    stats.same_filled++;
+    stats.stored++;
+    return entry;
+  }
+
+  size_t len = lz4_compress((u8 *)words, PAGE_SIZE, scratch, sizeof(scratch),
+                            lz4_work);
+
+  if (!len || stats.pool_bytes + len > pool_limit()) {
+    stats.rejected++;
+    kmem_cache_free(entry_cache, entry);
+    return NULL;
+  }
+
+  entry->data = kmem_alloc(len);
+  if (!entry->data) {
+    kmem_cache_free(entry_cache, entry);
+    return NULL;
+  }
+
+  memcpy(entry->data, scratch, len);
+  entry->len = len;
+  stats.pool_bytes += len;
+  stats.stored++;
+
+  return entry;
+}
+
+/* decompress the page behind `pte` into `frame`, the pte's reference goes */
+void zswap_load(uintptr_t pte, uintptr_t frame) {
+  struct zswap_entry *entry = pte_entry(pte);
+  void *dst = PAGING_VIRTUAL_OFFSET + (void *)frame;
+
+  if (!entry->len) {
+    u64 *words = dst;
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(u64); i++)
+      words[i] = entry->fill;
+  } else if (lz4_decompress(entry->data, entry->len, dst, PAGE_SIZE) !=
+             PAGE_SIZE) {
+    panic("zswap: corrupted compressed page");
+  }
+
+  stats.loads++;
+  zswap_drop(pte);
+}
+
+/* another pte points at the entry, after a fork */
+void zswap_dup(uintptr_t pte) { pte_entry(pte)->refs++; }
+
+void zswap_drop(uintptr_t pte) {
+  struct zswap_entry *entry = pte_entry(pte);
+
+  if (--entry->refs)
+    return;
+
+  if (entry->len) {
+    stats.pool_bytes -= entry->len;
+    kmem_free(entry->data);
+  } else {
+    stats.same_filled--;
+  }
+
+  stats.stored--;
+  kmem_cache_free(entry_cache, entry);
+}
+
+/* swap out the page mapped at `virt` if nobody else can see it */
+static bool reclaim_page(struct vmm_cursor *cur, uintptr_t virt,
+                         uintptr_t *pte) {
+  uintptr_t phys = *pte & PAGE_ADDR_MASK;
+  struct page *page = pmm_page(phys);
+
+  if (!page || (*pte & PAGE_COW) || page->refcount != 1 ||
+      page->mapcount != 1)
+    return false;
+
+  struct zswap_entry *entry = compress(phys);
+  if (!entry)
+    return false;
+
+  size_t size;
+  vmm_cursor_unmap(cur, virt, &size);
+  *pte = entry_pte(entry);
+  pmm_page_put(phys);
+
+  return true;
+}
+
+static struct vmm_anon_hand hand; // of the clock
+
+struct turn_ctx {
+  u64 want; // pages to compress at most
+  u64 done;
+  bool age; // clear the accessed bits on the way
+
+  // a reclaim that went past the end of the queue stops where it began
+  bool wrapped;
+  struct vmm_anon_hand start;
+};
+
+static int clock_page(ProcessControlBlock *proc, VASRangeNode *range,
+                      struct vmm_cursor *cur, uintptr_t virt, uintptr_t *pte,
+                      void *ctx) {
+  struct turn_ctx *tc = ctx;
+  (void)range;
+
+  if (tc->wrapped && proc == tc->start.proc && virt >= tc->start.virt)
+    return VMM_WALK_STOP;
+
+  // the tlb may still say the page is there, or was accessed
+  if (*pte & PAGE_ACCESSED) {
+    if (!tc->age)
+      return 0;
+
+    *pte &= ~(uintptr_t)PAGE_ACCESSED;
+    return VMM_WALK_CHANGED;
+  }
+
+  if (tc->done == tc->want || !reclaim_page(cur, virt, pte))
+    return 0;
+
+  if (++tc->done == tc->want)
+    return VMM_WALK_CHANGED | VMM_WALK_STOP;
+
+  return VMM_WALK_CHANGED;
+}
+
+static void report(u64 done) {
+  if (done)
+    kprintf("[ZSWAP] Compressed %llu pages, %llu stored in %llu KiB "
+            "(%llu same-filled, %llu rejected, %llu loaded)\n",
+            done, stats.stored, stats.pool_bytes / 1024, stats.same_filled,
+            stats.rejected, stats.loads);
+}
+
+/*
+ * Move the hand on to the end of the ready queue, or until `want` pages
+ * were compressed. Pages used since it last passed lose their accessed
+ * bit, the others are compressed. Returns how many were.
+ */
+static u64 turn(u64 want) {
+  struct turn_ctx tc = {.want = want, .done = 0, .age = true};
+
+  vmm_walk_anon(&hand, clock_page, &tc);
+  report(tc.done);
+
+  return tc.done;
+}
+
+/*
+ * Compress up to `pages` cold pages right away. Only pages the clock
+ * already found unused are taken, the hand goes once round at most.
+ */
+u64 zswap_reclaim(u64 pages) {
+  struct turn_ctx tc = {.want = pages, .done = 0, .start = hand};
+
+  if (vmm_walk_anon(&hand, clock_page, &tc) && tc.start.proc &&
+      tc.done < pages) {
+    tc.wrapped = true;
+    if (!vmm_walk_anon(&hand, clock_page, &tc) && tc.done < pages)
+      hand = tc.start;
+  }
+
+  report(tc.done);
+
+  return tc.done;
+}
+
+void zswap_init() {
+  // entries are found through ptes, there's nothing to construct
+  entry_cache = kmem_cache_create("zswap_entry", sizeof(struct zswap_entry),
+                                  0, NULL, NULL);
+}
+
+void zswap_proc() {
+  for (;;) {
+    proc_sleep(ZSWAP_SCAN_INTERVAL);
+
+    // the clock keeps turning while memory is plentiful, so the
+    // accessed bits are fresh when it isn't
+    bool low = pmm_get_free_block_count() < ZSWAP_LOW_PAGES;
+    turn(low ? ZSWAP_SCAN_BATCH : 0);
+  }
+}
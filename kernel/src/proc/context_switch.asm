@@ -1,5 +1,5 @@
 ; C declaration
-; void switch_to_process(Registers * trapframe, PageTable* cr3);
+; void switch_to_process(Registers * trapframe, u64 cr3);
 global switch_to_process
 
 %include "cpu/macros.mac"
@@ -8,7 +8,9 @@ global switch_to_process
 switch_to_process:
 
     mov rcx, cr3 
-    cmp rcx, rsi    ; check if new cr3 needs to be set
+    mov rax, rsi
+    btr rax, 63     ; the no-flush bit is never read back
+    cmp rcx, rax    ; check if new cr3 needs to be set
     je .done
 
     mov cr3, rsi    ; set new cr3
@@ -8,7 +8,9 @@
 #include <memory/slab.h>
 #include <libk/kprintf.h>
 #include <libk/typedefs.h>
+#include <libk/util.h>
 #include <memory/pmm.h>
+#include <memory/vmalloc.h>
 #include <memory/vmm.h>
 #include <proc/proc.h>
 #include <stdint.h>
@@ -54,13 +56,15 @@ Auxval load_elf_segments(ProcessControlBlock *proc, u8 *elf_data) {
 
       kprintf("[ELF]  Got interpreter file path: %s\n", ld_path);
       File *ld_file = vfs_open(ld_path, 0);
-      u8 *ld_data = kmem_alloc(ld_file->vn->stat.filesize);
+      u8 *ld_data = vmalloc(ld_file->vn->stat.filesize);
 
       ssize_t bytes_read = ld_file->vn->ops->read(
           ld_file, ld_file->vn, ld_data, ld_file->vn->stat.filesize, 0);
 
-      if (!(bytes_read != 0 && validate_elf(ld_data)))
+      if (!(bytes_read != 0 && validate_elf(ld_data))) {
+        vfree(ld_data);
         continue;
+      }
 
       Elf64_Ehdr *ld_hdr = (Elf64_Ehdr *)ld_data;
       aux.ld_entry = (LD_BASE + ld_hdr->e_entry);
@@ -73,53 +77,59 @@ Auxval load_elf_segments(ProcessControlBlock *proc, u8 *elf_data) {
           continue;
 
         u64 offset = ldph->p_vaddr & (PAGE_SIZE - 1);
-        u64 blocks = (ldph->p_memsz / PAGE_SIZE) + 2;
+        u64 blocks = DIV_ROUND_UP(offset + ldph->p_memsz, PAGE_SIZE);
 
         void *paddr = pmm_alloc_blocks(blocks) + PAGING_VIRTUAL_OFFSET;
         void *vaddr = (void *)(LD_BASE + (ldph->p_vaddr & ~(0xfff)));
 
-        memset(paddr, 0, ldph->p_memsz);
+        // only clear what the file contents don't overwrite
+        memset(paddr, 0, offset);
         memcpy(paddr + offset, (ld_data + ldph->p_offset), ldph->p_filesz);
+        memset(paddr + offset + ldph->p_filesz, 0,
+               blocks * PAGE_SIZE - offset - ldph->p_filesz);
 
         int page_flags = PAGE_USER | PAGE_WRITE | PAGE_PRESENT;
         vmm_map_range(vas, vaddr, paddr - PAGING_VIRTUAL_OFFSET,
-                      blocks * PAGE_SIZE, page_flags);
+                      blocks * PAGE_SIZE, page_flags, CACHE_WB);
 
-        VASRangeNode *range = kmem_alloc(sizeof(VASRangeNode));
+        VASRangeNode *range = kmem_cache_alloc(vas_range_cache);
 
         range->virt_start = vaddr;
-        range->phys_start = paddr - PAGING_VIRTUAL_OFFSET;
         range->size = blocks * PAGE_SIZE;
         range->page_flags = page_flags;
-        range->next = NULL;
+        range->vm_flags = VM_ANON;
 
         proc_add_vas_range(proc, range);
       }
+
+      vfree(ld_data);
     }
 
     if (p_header->p_type != PT_LOAD)
       continue;
 
     u64 offset = p_header->p_vaddr & (PAGE_SIZE - 1);
-    u64 blocks = (p_header->p_memsz / PAGE_SIZE) + 1;
+    u64 blocks = DIV_ROUND_UP(offset + p_header->p_memsz, PAGE_SIZE);
 
     void *phys_addr = pmm_alloc_blocks(blocks);
     void *virt_addr = (void *)(p_header->p_vaddr - offset);
 
-    memset(phys_addr, 0, p_header->p_memsz);
+    memset(phys_addr, 0, offset);
     memcpy(phys_addr + offset, (elf_data + p_header->p_offset),
            p_header->p_filesz);
+    memset(phys_addr + offset + p_header->p_filesz, 0,
+           blocks * PAGE_SIZE - offset - p_header->p_filesz);
 
     int page_flags = PAGE_USER | PAGE_WRITE | PAGE_PRESENT;
-    vmm_map_range(vas, virt_addr, phys_addr, blocks * PAGE_SIZE, page_flags);
+    vmm_map_range(vas, virt_addr, phys_addr, blocks * PAGE_SIZE, page_flags,
+                  CACHE_WB);
 
-    VASRangeNode *range = kmem_alloc(sizeof(VASRangeNode));
+    VASRangeNode *range = kmem_cache_alloc(vas_range_cache);
 
     range->virt_start = virt_addr;
-    range->phys_start = phys_addr;
     range->size = blocks * PAGE_SIZE;
     range->page_flags = page_flags;
-    range->next = NULL;
+    range->vm_flags = VM_ANON;
 
     proc_add_vas_range(proc, range);
   }
@@ -137,17 +147,18 @@ ProcessControlBlock *create_elf_process(const char *path, char *argvp[],
       ;
   }
 
-  uint8_t *elf_data = kmem_alloc(elf_file->vn->stat.filesize);
+  uint8_t *elf_data = vmalloc(elf_file->vn->stat.filesize);
 
   ssize_t bytes_read = elf_file->vn->ops->read(elf_file, elf_file->vn, elf_data,
                                                elf_file->vn->stat.filesize, 0);
 
   kprintf("Read data %s\n", elf_data);
-  if (!validate_elf(elf_data))
+  if (!validate_elf(elf_data)) {
+    vfree(elf_data);
     return NULL;
+  }
 
-  ProcessControlBlock *proc = (kmem_alloc(sizeof(ProcessControlBlock)));
-  memset(((void *)proc), 0, sizeof(ProcessControlBlock));
+  ProcessControlBlock *proc = kmem_cache_alloc(pcb_cache);
 
   memcpy(proc->name, path, 256);
 
@@ -156,25 +167,26 @@ ProcessControlBlock *create_elf_process(const char *path, char *argvp[],
 
   kprintf("Process stack at 0x%x\n", stack_ptr);
 
-  proc->vas = NULL;
+  proc->vas = RB_ROOT;
   proc->cr3 = vmm_create_user_proc_pml4(proc); // just maps kernel and returns
 
   int pflags = PAGE_USER | PAGE_WRITE | PAGE_PRESENT;
-  vmm_map_range(proc->cr3, stack_base, stack_base, STACK_SIZE, pflags);
+  vmm_map_range(proc->cr3, stack_base, stack_base, STACK_SIZE, pflags,
+                CACHE_WB);
 
-  VASRangeNode *range = kmem_alloc(sizeof(VASRangeNode));
+  VASRangeNode *range = kmem_cache_alloc(vas_range_cache);
 
   range->virt_start = stack_base;
-  range->phys_start = stack_base;
   range->size = STACK_SIZE;
   range->page_flags = pflags;
-  range->next = NULL;
+  range->vm_flags = VM_ANON;
 
   proc_add_vas_range(proc, range);
 
   kprintf("Elf file size is %llu bytes\n", elf_file->vn->stat.filesize);
 
   Auxval aux = load_elf_segments(proc, elf_data);
+  vfree(elf_data);
 
   uint64_t *stack = (uint64_t *)(stack_ptr);
 
@@ -250,8 +262,6 @@ ProcessControlBlock *create_elf_process(const char *path, char *argvp[],
   proc->fd_table[1] = vfs_open("/dev/tty0", O_WRONLY);
   proc->fd_table[2] = vfs_open("/dev/tty0", O_WRONLY);
 
-  proc->mmap_base = MMAP_BASE;
-
   proc->parent = NULL;
 
   proc->cr3 = (void *)proc->cr3 - PAGING_VIRTUAL_OFFSET;
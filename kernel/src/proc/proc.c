@@ -3,25 +3,47 @@
 #include "libk/util.h"
 #include "memory/vmm.h"
 #include <config.h>
+#include <drivers/pit.h>
 #include <drivers/video.h>
 #include <fs/vfs.h>
 #include <memory/slab.h>
 #include <libk/kprintf.h>
+#include <memory/ksm.h>
 #include <memory/pmm.h>
+#include <memory/thp.h>
+#include <memory/zero.h>
+#include <memory/zswap.h>
 #include <proc/elf.h>
 #include <proc/proc.h>
 #include <stdint.h>
 #include <string/string.h>
 #include <sys/queue.h>
 
-extern u64 g_ticks;
-extern void switch_to_process(Registers *new_stack, PageTable *cr3);
+extern void switch_to_process(Registers *new_stack, u64 cr3);
 extern void load_pagedir();
 
 ProcessControlBlock *running = NULL;
 
 uint64_t pid_counter = 200;
 
+struct kmem_cache *pcb_cache;
+struct kmem_cache *vas_range_cache;
+
+static void pcb_ctor(void *obj) {
+  ProcessControlBlock *pcb = obj;
+  memset(pcb, 0, sizeof(ProcessControlBlock));
+  TAILQ_INIT(&pcb->children);
+}
+
+static void vas_range_ctor(void *obj) { memset(obj, 0, sizeof(VASRangeNode)); }
+
+void proc_cache_init() {
+  pcb_cache = kmem_cache_create("pcb", sizeof(ProcessControlBlock), 64,
+                                pcb_ctor, NULL);
+  vas_range_cache = kmem_cache_create("vas_range", sizeof(VASRangeNode), 0,
+                                      vas_range_ctor, NULL);
+}
+
 struct procq readyq;
 
 void dump_readyq() {
@@ -98,45 +120,206 @@ void idle_task() {
 }
 
 void dump_proc_vas(ProcessControlBlock *proc) {
-  VASRangeNode *cnode = proc->vas;
   kprintf("---------PROCESS VAS---------\n");
 
-  if (proc->vas) {
+  for (VASRangeNode *cnode = proc_first_vas_range(proc); cnode;
+       cnode = proc_next_vas_range(cnode))
     kprintf("start: %x; size: %x; flags: %d\n", cnode->virt_start, cnode->size,
             cnode->page_flags);
+}
+
+/*
+ * The VAS of a process is a red-black tree of ranges ordered by start
+ * address. Ranges never overlap, so ordering by start also orders them by
+ * end, and lookups by address are a single descent.
+ */
+
+static inline uintptr_t vas_start(VASRangeNode *range) {
+  return (uintptr_t)range->virt_start;
+}
 
-    while (cnode->next != NULL) {
-      kprintf("start: %x; size: %x; flags: %d\n", cnode->virt_start,
-              cnode->size, cnode->page_flags);
+static inline uintptr_t vas_end(VASRangeNode *range) {
+  return (uintptr_t)range->virt_start + range->size;
+}
+
+static inline VASRangeNode *vas_entry(struct rb_node *node) {
+  return rb_entry_safe(node, VASRangeNode, rb);
+}
 
-      cnode = cnode->next;
+VASRangeNode *proc_find_vas_range(ProcessControlBlock *proc, uintptr_t addr) {
+  struct rb_node *node = proc->vas.node;
+
+  while (node) {
+    VASRangeNode *range = vas_entry(node);
+
+    if (addr < vas_start(range))
+      node = node->left;
+    else if (addr >= vas_end(range))
+      node = node->right;
+    else
+      return range;
+  }
+
+  return NULL;
+}
+
+/* first range that ends after addr */
+VASRangeNode *proc_vas_lower_bound(ProcessControlBlock *proc,
+                                   uintptr_t addr) {
+  struct rb_node *node = proc->vas.node;
+  VASRangeNode *found = NULL;
+
+  while (node) {
+    VASRangeNode *range = vas_entry(node);
+
+    if (vas_end(range) > addr) {
+      found = range;
+      node = node->left;
+    } else {
+      node = node->right;
     }
   }
+
+  return found;
 }
 
+static void vas_insert(ProcessControlBlock *proc, VASRangeNode *range) {
+  struct rb_node **link = &proc->vas.node;
+  struct rb_node *parent = NULL;
+
+  while (*link) {
+    parent = *link;
+    if (vas_start(range) < vas_start(vas_entry(parent)))
+      link = &parent->left;
+    else
+      link = &parent->right;
+  }
+
+  rb_link_node(&range->rb, parent, link);
+  rb_insert_color(&range->rb, &proc->vas);
+}
+
+static bool vas_mergeable(VASRangeNode *a, VASRangeNode *b) {
+  return vas_end(a) == vas_start(b) && a->page_flags == b->page_flags &&
+         a->vm_flags == b->vm_flags;
+}
+
+/* the cache hands out zeroed nodes, they go back the way they came */
+static void vas_range_free(VASRangeNode *node) {
+  memset(node, 0, sizeof(VASRangeNode));
+  kmem_cache_free(vas_range_cache, node);
+}
+
+/* `node` may be merged into a neighbour and freed, don't use it after */
 void proc_add_vas_range(ProcessControlBlock *proc, VASRangeNode *node) {
-  if (!proc->vas)
-    proc->vas = node;
+  // a new mapping replaces whatever was there before
+  proc_remove_vas_range(proc, vas_start(node), node->size);
+
+  node->fault_next = 0;
+  node->fault_window = 0;
+  vas_insert(proc, node);
+
+  VASRangeNode *prev = vas_entry(rb_prev(&node->rb));
+  if (prev && vas_mergeable(prev, node)) {
+    prev->size += node->size;
+    rb_erase(&node->rb, &proc->vas);
+    vas_range_free(node);
+    node = prev;
+  }
+
+  VASRangeNode *next = vas_entry(rb_next(&node->rb));
+  if (next && vas_mergeable(node, next)) {
+    node->size += next->size;
+    rb_erase(&next->rb, &proc->vas);
+    vas_range_free(next);
+  }
+}
+
+/* drop [start, start + size) from the vas, splitting ranges that straddle it */
+void proc_remove_vas_range(ProcessControlBlock *proc, uintptr_t start,
+                           size_t size) {
+  uintptr_t end = start + size;
+  VASRangeNode *range = proc_vas_lower_bound(proc, start);
+
+  while (range && vas_start(range) < end) {
+    VASRangeNode *next = vas_entry(rb_next(&range->rb));
+    uintptr_t range_end = vas_end(range);
+
+    if (vas_start(range) < start && range_end > end) {
+      // hole in the middle, the tail becomes its own range
+      VASRangeNode *tail = kmem_cache_alloc(vas_range_cache);
+      tail->virt_start = (void *)end;
+      tail->size = range_end - end;
+      tail->page_flags = range->page_flags;
+      tail->vm_flags = range->vm_flags;
+      tail->fault_next = 0;
+      tail->fault_window = 0;
+
+      range->size = start - vas_start(range);
+      vas_insert(proc, tail);
+      return;
+    }
+
+    if (vas_start(range) < start) {
+      range->size = start - vas_start(range);
+    } else if (range_end > end) {
+      // still sorts between the same neighbours
+      range->virt_start = (void *)end;
+      range->size = range_end - end;
+    } else {
+      rb_erase(&range->rb, &proc->vas);
+      vas_range_free(range);
+    }
 
-  VASRangeNode *cnode = proc->vas;
+    range = next;
+  }
+}
+
+static bool vas_free(ProcessControlBlock *proc, uintptr_t start, size_t size) {
+  VASRangeNode *range = proc_vas_lower_bound(proc, start);
+  return !range || vas_start(range) >= start + size;
+}
 
-  while (cnode->next != NULL)
-    cnode = cnode->next;
+/* lowest aligned gap of `size` bytes in [lo, hi), 0 if there is none */
+static uintptr_t vas_gap(ProcessControlBlock *proc, uintptr_t lo, uintptr_t hi,
+                         size_t size, size_t align) {
+  uintptr_t start = ALIGN_UP(lo, align);
+
+  for (VASRangeNode *range = proc_vas_lower_bound(proc, lo); range;
+       range = proc_next_vas_range(range)) {
+    if (start + size <= vas_start(range) || start + size > hi)
+      break;
+
+    start = ALIGN_UP(MAX(start, vas_end(range)), align);
+  }
 
-  cnode->next = node;
-  node->next = NULL;
+  return start + size <= hi ? start : 0;
+}
+
+/*
+ * Pick where a new mapping of `size` bytes goes. A page aligned `hint` is
+ * taken if nothing is mapped there yet, otherwise the lowest gap between
+ * MMAP_BASE and MMAP_END with room for an `align` aligned start is used.
+ * Space freed by munmap is found again like any other gap. Returns 0 when
+ * the address space is full.
+ */
+uintptr_t proc_find_vas_gap(ProcessControlBlock *proc, uintptr_t hint,
+                            size_t size, size_t align) {
+  if (hint && !(hint & (PAGE_SIZE - 1)) && hint + size > hint &&
+      hint + size <= MMAP_END && vas_free(proc, hint, size))
+    return hint;
+
+  return vas_gap(proc, MMAP_BASE, MMAP_END, size, align);
 }
 
 ProcessControlBlock *create_kernel_process(void (*entry)(void), char *name) {
 
-  ProcessControlBlock *pcb = kmem_alloc(sizeof(ProcessControlBlock));
-  memset(pcb, 0, sizeof(ProcessControlBlock));
+  ProcessControlBlock *pcb = kmem_cache_alloc(pcb_cache);
 
   memcpy(&pcb->name, name, 256);
 
   void *stack_ptr = pmm_alloc_blocks(STACK_BLOCKS) + STACK_SIZE;
   pcb->kstack = stack_ptr;
-  memset(&pcb->trapframe, 0, sizeof(Registers));
 
   pcb->trapframe.ss = 0x10;
   pcb->trapframe.rsp = (uint64_t)stack_ptr;
@@ -145,6 +328,7 @@ ProcessControlBlock *create_kernel_process(void (*entry)(void), char *name) {
   pcb->trapframe.rip = (uint64_t)entry;
 
   pcb->cr3 = vmm_get_current_cr3(); // kernel cr3
+  pcb->pcid = 0;
   pcb->state = READY;
   pcb->pid = pid_counter++;
 
@@ -153,11 +337,11 @@ ProcessControlBlock *create_kernel_process(void (*entry)(void), char *name) {
 
 ProcessControlBlock *clone_process(ProcessControlBlock *proc, Registers *regs) {
 
-  ProcessControlBlock *clone = kmem_alloc(sizeof(ProcessControlBlock));
+  ProcessControlBlock *clone = kmem_cache_alloc(pcb_cache);
   *clone = *proc;
 
   // reset vas so that proper phys addrs get put by vmm_copy_vas
-  clone->vas = NULL;
+  clone->vas = RB_ROOT;
 
   vmm_copy_vas(clone, proc);
 
@@ -183,6 +367,25 @@ void register_process(ProcessControlBlock *new) {
   return;
 }
 
+/*
+ * Let the running process wait for `ticks` timer ticks. It stays off the
+ * cpu until get_next_ready_process sees its wakeup tick has passed.
+ */
+void proc_sleep(u64 ticks) {
+  ProcessControlBlock *self = running;
+  u64 wakeup = g_ticks + ticks;
+
+  // the scheduler runs it anyway when nothing else is ready
+  while (g_ticks < wakeup) {
+    u64 flags = irq_save();
+    self->wakeup = wakeup;
+    self->state = WAITING;
+    irq_restore(flags);
+
+    asm volatile("hlt");
+  }
+}
+
 void multitasking_init() {
   TAILQ_INIT(&readyq);
 
@@ -194,10 +397,15 @@ void multitasking_init() {
   kprintf("process is @ %p", gcon);
   register_process(gcon);
   register_process(create_kernel_process(fb_proc, "Screen"));
+  register_process(create_kernel_process(zero_proc, "Zero"));
+  register_process(create_kernel_process(kmem_reaper_proc, "Reaper"));
+  register_process(create_kernel_process(thp_proc, "Collapse"));
+  register_process(create_kernel_process(zswap_proc, "Zswap"));
+  register_process(create_kernel_process(ksm_proc, "Merge"));
 
   dump_readyq();
 
   running = TAILQ_FIRST(&readyq);
-  switch_to_process(&running->trapframe, (void *)running->cr3);
+  switch_to_process(&running->trapframe, vmm_proc_cr3(running));
   return;
 }
@@ -2,22 +2,35 @@
 #include "memory/vmm.h"
 #include <config.h>
 #include <cpu/idt.h>
+#include <drivers/pit.h>
 #include <memory/slab.h>
 #include <libk/kprintf.h>
 #include <proc/proc.h>
 
-extern void switch_to_process(void *new_stack, PageTable *cr3);
+extern void switch_to_process(void *new_stack, u64 cr3);
 extern void load_pagedir();
 
-extern u64 g_ticks;
-
 extern PageTable *kernel_cr3;
 
 extern volatile ProcessControlBlock *running;
 
+/* the next process that isn't waiting, `running` if all of them are */
 ProcessControlBlock *get_next_ready_process() {
-  ProcessControlBlock *next = TAILQ_NEXT(running, entries);
-  return next == NULL ? TAILQ_FIRST(&readyq) : next;
+  ProcessControlBlock *next = (ProcessControlBlock *)running;
+
+  do {
+    next = TAILQ_NEXT(next, entries);
+    if (next == NULL)
+      next = TAILQ_FIRST(&readyq);
+
+    // proc_sleep is over
+    if (next->state == WAITING && next->wakeup && g_ticks >= next->wakeup) {
+      next->wakeup = 0;
+      next->state = READY;
+    }
+  } while (next->state == WAITING && next != running);
+
+  return next;
 }
 
 void schedule(Registers *regs) {
@@ -49,5 +62,6 @@ void schedule(Registers *regs) {
   wrmsr(FSBASE, running->fs_base);
   get_cpu_struct(0)->syscall_kernel_stack =
       running->kstack + PAGING_VIRTUAL_OFFSET;
-  switch_to_process(&running->trapframe, (void *)running->cr3);
+  switch_to_process(&running->trapframe,
+                    vmm_proc_cr3((ProcessControlBlock *)running));
 }
@@ -10,7 +10,9 @@
 #include <libk/typedefs.h>
 #include <libk/util.h>
 #include <memory/pmm.h>
+#include <memory/vmalloc.h>
 #include <memory/vmm.h>
+#include <memory/zero.h>
 #include <proc/proc.h>
 #include <stdint.h>
 #include <string/string.h>
@@ -38,7 +40,7 @@ extern ProcessControlBlock *running;
 extern PageTable *kernel_cr3;
 
 extern __attribute__((noreturn)) void switch_to_process(Registers *new_stack,
-                                                        PageTable *cr3);
+                                                        u64 cr3);
 
 extern void set_kernel_entry(void *rip);
 
@@ -177,6 +179,23 @@ ssize_t sys_write(int fd, char *ptr, int len) {
   return file->vn->ops->write(file, file->vn, ptr, len, file->pos);
 }
 
+/* take down the pages of every range in [start, start + size) */
+static void unmap_ranges(ProcessControlBlock *proc, uintptr_t start,
+                         size_t size) {
+  PageTable *pml4 = (void *)proc->cr3 + PAGING_VIRTUAL_OFFSET;
+  uintptr_t end = start + size;
+
+  // private frames are ours to drop, shared ones belong to the device
+  for (VASRangeNode *range = proc_vas_lower_bound(proc, start);
+       range && (uintptr_t)range->virt_start < end;
+       range = proc_next_vas_range(range)) {
+    uintptr_t from = MAX(start, (uintptr_t)range->virt_start);
+    uintptr_t to = MIN(end, (uintptr_t)range->virt_start + range->size);
+
+    vmm_unmap_range(pml4, from, to - from, range->vm_flags & VM_ANON);
+  }
+}
+
 void *sys_vm_map(ProcessControlBlock *proc, void *addr, size_t size, int prot,
                  int flags, int fd, off_t offset) {
 
@@ -188,14 +207,12 @@ void *sys_vm_map(ProcessControlBlock *proc, void *addr, size_t size, int prot,
   if (flags & MAP_SHARED)
     kprintf("MAP_SHARED");
 
-  // size isn't page aligned
-  if (size % PAGE_SIZE != 0) {
-    kprintf("[MMAP] Size wasn't page aligned");
-    return NULL;
-  }
+  // the mapping covers whole pages
+  size = ALIGN_UP(size, PAGE_SIZE);
 
-  int pages = DIV_ROUND_UP(size, PAGE_SIZE);
+  int pages = size / PAGE_SIZE;
   void *phys_base;
+  void *shared_buf = NULL;
 
   static int count = 0;
   if (flags & MAP_SHARED) {
@@ -208,30 +225,36 @@ void *sys_vm_map(ProcessControlBlock *proc, void *addr, size_t size, int prot,
     TmpNode *tnode = vnode->private_data;
 
     // FIXME: only being used for /dev/fb0
-    phys_base = tnode->dev.cdev.private_data - PAGING_VIRTUAL_OFFSET;
+    shared_buf = tnode->dev.cdev.private_data;
+    phys_base = (void *)vmalloc_to_phys(shared_buf);
     kprintf("Framebuffer phys-base @ 0x%x\n", phys_base);
     kprintf("Called mmap on %s\n", tnode->name);
-  } else {
-    phys_base = pmm_alloc_blocks(pages);
-    memset(PAGING_VIRTUAL_OFFSET + phys_base, 0, pages * PAGE_SIZE);
-  }
 
-  if (phys_base == NULL) {
-    // out of memory
-    for (;;)
-      kprintf("Out of memory\n");
-    return NULL;
+    if (phys_base == NULL) {
+      for (;;)
+        kprintf("Framebuffer isn't mapped\n");
+      return NULL;
+    }
   }
 
   void *virt_base = NULL;
   if (flags & MAP_FIXED && addr != NULL) {
     virt_base = addr;
+
+    // whatever was mapped there goes, the new range starts out empty
+    unmap_ranges(proc, (uintptr_t)virt_base, size);
+    vmm_flush_tlb(proc);
   } else {
-    virt_base = (void *)proc->mmap_base;
-    proc->mmap_base += size;
+    // large mappings start 2M aligned so they can be backed by huge pages
+    size_t align = size >= PAGE_SIZE_2M ? PAGE_SIZE_2M : PAGE_SIZE;
+
+    virt_base = (void *)proc_find_vas_gap(proc, (uintptr_t)addr, size, align);
+    if (virt_base == NULL) {
+      kprintf("[MMAP] No room for 0x%llx bytes\n", size);
+      return NULL;
+    }
   }
 
-  kprintf("[MMAP] Found free chunk at 0x%x phys\n", phys_base);
   int page_flags = PAGE_USER | PAGE_PRESENT | PAGE_WRITE;
 
   if (flags & PROT_WRITE)
@@ -239,14 +262,46 @@ void *sys_vm_map(ProcessControlBlock *proc, void *addr, size_t size, int prot,
 
   kprintf("Virt base is %x\n", virt_base);
 
-  vmm_map_range((void *)proc->cr3 + PAGING_VIRTUAL_OFFSET, virt_base, phys_base,
-                size, page_flags);
+  struct vmm_cursor cur;
+  vmm_cursor_init(&cur, (void *)proc->cr3 + PAGING_VIRTUAL_OFFSET);
 
-  VASRangeNode *range = kmem_alloc(sizeof(VASRangeNode));
+  if (shared_buf) {
+    // the buffer is only virtually contiguous, map it page by page and
+    // reuse the kernel's huge pages where they line up
+    size_t step;
+    for (size_t off = 0; off < size; off += step) {
+      uintptr_t phys = vmalloc_to_page(shared_buf + off, &step);
+      uintptr_t virt = (uintptr_t)virt_base + off;
+
+      if (step == PAGE_SIZE_2M && !(virt & (PAGE_SIZE_2M - 1)) &&
+          !(phys & (PAGE_SIZE_2M - 1)) && size - off >= PAGE_SIZE_2M &&
+          vmm_cursor_map(&cur, virt, phys, page_flags, PAGE_SIZE_2M))
+        continue;
+
+      step = PAGE_SIZE;
+      vmm_cursor_map(&cur, virt, phys, page_flags, step);
+    }
+  } else if (flags & MAP_POPULATE) {
+    for (int i = 0; i < pages; i++) {
+      void *page = zero_alloc_block();
+      if (page == NULL) {
+        // out of memory
+        for (;;)
+          kprintf("Out of memory\n");
+        return NULL;
+      }
+
+      vmm_cursor_map(&cur, (uintptr_t)virt_base + i * PAGE_SIZE,
+                     (uintptr_t)page, page_flags, PAGE_SIZE);
+    }
+  }
+  // otherwise anonymous pages are only put in by the page fault handler
+
+  VASRangeNode *range = kmem_cache_alloc(vas_range_cache);
   range->virt_start = virt_base;
-  range->phys_start = phys_base;
   range->size = pages * PAGE_SIZE;
   range->page_flags = page_flags;
+  range->vm_flags = flags & MAP_SHARED ? VM_SHARED : VM_ANON;
 
   proc_add_vas_range(proc, range);
 
@@ -254,6 +309,70 @@ void *sys_vm_map(ProcessControlBlock *proc, void *addr, size_t size, int prot,
   return virt_base;
 }
 
+int sys_vm_unmap(ProcessControlBlock *proc, void *addr, size_t size) {
+  uintptr_t start = (uintptr_t)addr;
+
+  if (start % PAGE_SIZE != 0) {
+    kprintf("[MUNMAP] Range wasn't page aligned\n");
+    return -1;
+  }
+
+  // a partial last page goes as a whole
+  size = ALIGN_UP(size, PAGE_SIZE);
+
+  unmap_ranges(proc, start, size);
+  proc_remove_vas_range(proc, start, size);
+  vmm_flush_tlb(proc);
+
+  return 0;
+}
+
+int sys_vm_protect(ProcessControlBlock *proc, void *addr, size_t size,
+                   int prot) {
+  uintptr_t virt = (uintptr_t)addr;
+  uintptr_t end = virt + ALIGN_UP(size, PAGE_SIZE);
+
+  if (virt % PAGE_SIZE != 0) {
+    kprintf("[MPROTECT] Range wasn't page aligned\n");
+    return -1;
+  }
+
+  // without the user bit the pages stay mapped but only for the kernel
+  int page_flags = PAGE_PRESENT;
+  if (prot != PROT_NONE)
+    page_flags |= PAGE_USER;
+  if (prot & PROT_WRITE)
+    page_flags |= PAGE_WRITE;
+
+  PageTable *pml4 = (void *)proc->cr3 + PAGING_VIRTUAL_OFFSET;
+
+  // each piece becomes its own range, which may merge with its neighbours
+  while (virt < end) {
+    VASRangeNode *range = proc_vas_lower_bound(proc, virt);
+    if (!range || (uintptr_t)range->virt_start >= end)
+      break;
+
+    uintptr_t from = MAX(virt, (uintptr_t)range->virt_start);
+    uintptr_t to = MIN(end, (uintptr_t)range->virt_start + range->size);
+    int vm_flags = range->vm_flags;
+
+    vmm_protect_range(pml4, from, to - from, page_flags, vm_flags & VM_SHARED);
+
+    VASRangeNode *node = kmem_cache_alloc(vas_range_cache);
+    node->virt_start = (void *)from;
+    node->size = to - from;
+    node->page_flags = page_flags;
+    node->vm_flags = vm_flags;
+
+    proc_add_vas_range(proc, node);
+    virt = to;
+  }
+
+  vmm_flush_tlb(proc);
+
+  return 0;
+}
+
 off_t sys_seek(int fd, off_t offset, int whence) {
   if (!valid_fd(fd)) {
     kprintf("Invalid fd ...");
@@ -600,6 +719,17 @@ void syscall_dispatcher(Registers *regs) {
 
     break;
   }
+  case SYS_VM_UNMAP: {
+    kprintf("[SYS]  VM_UNMAP CALLED\n");
+    regs->rax = sys_vm_unmap(running, (void *)regs->rdi, regs->rsi);
+    break;
+  }
+  case SYS_VM_PROTECT: {
+    kprintf("[SYS]  VM_PROTECT CALLED\n");
+    regs->rax =
+        sys_vm_protect(running, (void *)regs->rdi, regs->rsi, regs->rdx);
+    break;
+  }
   case SYS_SEEK: {
     kprintf("[SYS]  SEEK CALLED\n");
     regs->rax = sys_seek(regs->rdi, regs->rsi, regs->rdx);
@@ -697,16 +827,14 @@ void syscall_dispatcher(Registers *regs) {
 
 void sys_init() {
   cpu_init(0);
-  LocalCpuData *lcd = get_cpu_struct(0);
 
   wrmsr(EFER, rdmsr(EFER) | 1); // enable syscall
 
   extern void enable_sce(); // syscall_entry.asm
   enable_sce();
 
-  wrmsr(GSBASE, (u64)lcd);  //  GSBase
-  wrmsr(KGSBASE, (u64)lcd); // KernelGSBase
-  wrmsr(SFMASK, (u64)0);    // KernelGSBase
+  cpu_load_locals(0);
+  wrmsr(SFMASK, (u64)0); // KernelGSBase
 
   extern void syscall_entry(); // syscall_entry.asm
   wrmsr(LSTAR, (u64)&syscall_entry);